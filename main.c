@@ -1,5 +1,6 @@
 #ifdef __EMSCRIPTEN__
 #include <emscripten.h>
+#include <emscripten/html5.h>
 #endif
 
 #include <SDL.h>
@@ -14,6 +15,34 @@
 #include <stdlib.h>
 #include <sys/time.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#if !defined(__EMSCRIPTEN__) && !defined(WIN32)
+#define NETPLAY
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#ifndef __EMSCRIPTEN__
+#define TELEMETRY
+#endif
+
+#if defined(__linux__) && !defined(__EMSCRIPTEN__)
+#define HOT_RELOAD
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#ifndef __EMSCRIPTEN__
+#define SIM_THREAD
+#endif
+
 const char *window_title = "LD46 - Icy Mountain Hot Potato";
 const uint32_t screen_width = 1280;
 const uint32_t screen_height = 720;
@@ -56,6 +85,56 @@ const float camera_move_factor = 0.04f;
 
 #define MAX_NUM_BRICKS 256
 
+#define INPUT_LEFT 0x1
+#define INPUT_RIGHT 0x2
+#define INPUT_DOWN 0x4
+#define INPUT_JUMP 0x8
+#define INPUT_RESTART 0x10 // versus only; step() ignores it
+
+#define MAX_COYOTE_STEPS 16
+#define MAX_JUMP_ARC_STEPS 256
+
+#define SEED_INDEX_MAGIC 0x53484d49   // "IMHS"
+#define SEED_INDEX_HEADER_SIZE 12     // bytes
+
+#define BENCH_NUM_BRICKS 4096
+#define BENCH_LEVEL_HEIGHT 16384.0f   // pixels
+
+#define EVENT_JUMP 0x01
+#define EVENT_BOUNCE_START 0x02
+#define EVENT_BOUNCE_END 0x04
+#define EVENT_BRICK_BREAK 0x08
+#define EVENT_GAME_OVER 0x10
+#define EVENT_SYNC 0x40        // telemetry only
+#define EVENT_LEVEL_START 0x80 // telemetry only
+
+#define TELEMETRY_MAGIC 0x54484d49          // "IMHT"
+#define TELEMETRY_VERSION 1
+#define TELEMETRY_SCALE 16.0f               // fixed point units per pixel
+#define TELEMETRY_NUM_FIELDS 10
+#define TELEMETRY_MAX_RECORD_SIZE 64        // bytes
+#define TELEMETRY_RING_SIZE (1 << 20)       // bytes, power of two
+#define TELEMETRY_FLUSH_INTERVAL 250        // milliseconds
+
+#define RENDER_SNAPSHOT_FRESH 0x4 // set on the newest slot until the renderer takes it
+#define SIM_MAX_CATCHUP_STEPS 8   // steps
+#define IDLE_WAIT_TIMEOUT 250     // milliseconds
+
+#define PROFILE_MAX_THREADS 64
+#define PROFILE_RING_SIZE 65536       // events per thread, power of two
+
+#define NET_MAGIC 0x4c443436          // "LD46"
+#define NET_HISTORY 64                // steps, power of two
+#define NET_MAX_ROLLBACK 8            // steps
+#define NET_MAX_INPUTS_PER_PACKET 32  // steps
+#define NET_PACKET_HEADER_SIZE 17     // bytes
+#define NET_MAX_PACKET_SIZE (NET_PACKET_HEADER_SIZE + NET_MAX_INPUTS_PER_PACKET)
+#define NET_QUEUE_SIZE 256            // packets
+#define NET_RESTART_DELAY (NET_MAX_ROLLBACK + 1) // steps from a restart request to the restart
+#define NET_TIMEOUT 5000              // milliseconds without packets before the peer is dropped
+
+const char *assets_dir = "assets";
+
 const char *game_over_text = " press R to restart ";
 const char *fps_text = "FPS: ";
 
@@ -67,6 +146,96 @@ typedef struct {
     float x, y;
 } brick_t;
 
+// Everything step() reads or writes. Brick pointers are stored as indices so
+// that a snapshot can be restored into the global bricks array.
+typedef struct {
+    body_t ball, player;
+    brick_t bricks[MAX_NUM_BRICKS];
+    float last_ball_px, last_ball_py;
+    float last_player_px, last_player_py;
+    float player_carry_offset;
+    float stored_ball_vx, stored_ball_vy, stored_ball_py;
+    float camera_y, camera_focus_y;
+    uint32_t ball_carry_time, ball_bounce_time;
+    uint32_t air_time, jump_time;
+    uint32_t time_since_jump_press, time_since_jump_release;
+    uint32_t score;
+    int player_brick, hit_brick;
+    bool left_pressed, right_pressed, down_pressed, jump_pressed;
+    bool player_on_ground, player_carrying_ball, player_jumping, ball_bouncing;
+    bool left_pressed_entering_carry_state, right_pressed_entering_carry_state;
+    bool game_over;
+} snapshot_t;
+
+// Everything render() reads, copied out of the simulation after each step so
+// that rendering never touches live simulation state.
+typedef struct {
+    body_t ball, player;
+    body_t remote_ball, remote_player;
+    int ball_sprite, player_sprite;
+    int remote_ball_sprite, remote_player_sprite;
+    brick_t bricks[MAX_NUM_BRICKS]; // visible ones only
+    int num_bricks;
+    float camera_y;
+    uint32_t score, high_score, remote_score;
+    bool show_remote;
+    bool show_game_over;
+} render_snapshot_t;
+
+// A file loaded into either a texture or a sound effect. The registry owns
+// the loaded object and publishes it through the pointer it was given, so the
+// rest of the game can keep using plain globals across reloads.
+typedef struct {
+    const char *path;
+    SDL_Texture **texture;
+    Mix_Chunk **chunk;
+    SDL_Surface *sprite; // premultiplied ARGB8888, CPU renderer only
+    int w, h;            // pixels
+    size_t cpu_bytes;    // resident in main memory
+    size_t gpu_bytes;    // estimated texture memory
+} asset_t;
+
+// Player positions, relative to the edge of the cluster it leaves, for each
+// step of a jump at full horizontal speed.
+typedef struct {
+    int len;
+    int jump_step; // steps before this one are spent walking off the edge
+    int apex;
+    float px[MAX_JUMP_ARC_STEPS];
+    float py[MAX_JUMP_ARC_STEPS];
+} jump_arc_t;
+
+typedef struct {
+    uint32_t first_seed;
+    uint32_t num_seeds;
+    uint8_t *bits;
+    uint32_t num_good;
+} validate_job_t;
+
+#ifdef PROFILE
+typedef struct {
+    uint64_t ticks;
+    const char *name;
+    char phase; // 'B' or 'E', as in the Chrome trace event format
+} profile_event_t;
+
+// Written only by its owning thread. head counts every event ever recorded,
+// so the oldest events are overwritten once it passes PROFILE_RING_SIZE.
+typedef struct {
+    const char *thread_name;
+    SDL_atomic_t head;
+    profile_event_t events[PROFILE_RING_SIZE];
+} profile_buffer_t;
+#endif
+
+#ifdef NETPLAY
+typedef struct {
+    uint32_t send_time;
+    int len;
+    uint8_t data[NET_MAX_PACKET_SIZE];
+} net_packet_t;
+#endif
+
 bool check_collision_circle_rect(float, float, float, float, float, float, float);
 bool check_collision_rect_rect(float, float, float, float, float, float, float, float);
 
@@ -74,9 +243,98 @@ float accelerate(float);
 float decelerate(float);
 float pivot(float);
 
-float rand_range(float, float);
+#ifdef PROFILE
+void profile_thread(const char *);
+void profile_record(const char *, char);
+void profile_zone_end(int *);
+void profile_dump(const char *);
+
+// PROFILE_ZONE lasts until the end of the enclosing block, PROFILE_BEGIN and
+// PROFILE_END bracket straight-line code. All of them compile to nothing
+// unless PROFILE is defined.
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_ZONE(name) \
+    __attribute__((cleanup(profile_zone_end))) int PROFILE_CONCAT(profile_zone_, __LINE__) = (profile_record(name, 'B'), 0)
+#define PROFILE_BEGIN(name) profile_record(name, 'B')
+#define PROFILE_END() profile_record(NULL, 'E')
+#define PROFILE_THREAD(name) profile_thread(name)
+#define PROFILE_DUMP(path) profile_dump(path)
+#else
+#define PROFILE_ZONE(name)
+#define PROFILE_BEGIN(name)
+#define PROFILE_END()
+#define PROFILE_THREAD(name)
+#define PROFILE_DUMP(path)
+#endif
+
+uint32_t next_random(uint32_t *);
+float rand_range(uint32_t *, float, float);
 float positive_fmod(float, float);
 
+float generate_level(uint32_t, brick_t *);
+void init_jump_arcs();
+bool check_level_reachable(const brick_t *);
+int validate_seeds(uint32_t, uint32_t, const char *);
+bool pick_daily_seed(const char *, uint32_t *);
+
+int cull_bricks(brick_t *, const brick_t *, int, float);
+void publish_render_snapshot();
+const render_snapshot_t *take_render_snapshot();
+uint32_t time_to_next_snapshot();
+void render(const render_snapshot_t *);
+void run_render_benchmark(uint32_t);
+
+bool init_framebuffer();
+void free_framebuffer();
+bool save_framebuffer(const char *);
+void clear_frame();
+void draw_sprite(int, const SDL_Rect *, const SDL_Rect *);
+void draw_sprite_alpha(int, const SDL_Rect *, const SDL_Rect *, uint8_t);
+void present_frame();
+
+bool load_asset(asset_t *);
+bool load_assets();
+void print_asset_memory();
+void free_assets();
+#ifdef HOT_RELOAD
+void watch_assets();
+void reload_changed_assets();
+#endif
+
+#ifdef TELEMETRY
+bool telemetry_open(const char *);
+void telemetry_start_level(uint32_t);
+void telemetry_record_tick();
+void telemetry_close();
+#endif
+
+void save_state(snapshot_t *);
+void load_state(const snapshot_t *);
+void play_sfx(uint8_t);
+void play_queued_sfx();
+void sim_tick(uint8_t);
+void wake_sim();
+#ifdef SIM_THREAD
+int sim_thread_main(void *);
+#endif
+
+void handle_window_event(const SDL_WindowEvent *);
+void update_paused();
+bool is_idle();
+#ifdef __EMSCRIPTEN__
+EM_BOOL on_visibility_change(int, const EmscriptenVisibilityChangeEvent *, void *);
+#endif
+
+#ifdef NETPLAY
+bool net_open(uint16_t, const char *);
+void net_update(uint8_t);
+void net_close();
+void net_step(uint32_t, uint8_t, bool);
+uint64_t hash_loaded_state();
+void net_test_update();
+#endif
+
 int next_brick;
 
 uint32_t last_fps_update_time;
@@ -120,6 +378,9 @@ brick_t *hit_brick;
 
 bool game_over;
 
+// EVENT_* flags raised by the last step().
+uint8_t tick_events;
+
 uint32_t high_score;
 uint32_t score;
 
@@ -131,7 +392,6 @@ brick_t bricks[MAX_NUM_BRICKS];
 
 SDL_Window *win;
 SDL_Renderer *renderer;
-SDL_Surface *loading_surf;
 SDL_Texture *ball_texture, *ball_squash_texture, *player_texture, *player_jump_texture, *player_fall_texture, *brick_texture;
 SDL_Texture *white_on_black_number_textures[10];
 SDL_Texture *white_numbers_texture;
@@ -140,10 +400,69 @@ SDL_Texture *game_over_text_texture;
 SDL_Texture *fps_text_texture;
 Mix_Chunk *sfx_jump, *sfx_game_over, *sfx_bounce_start, *sfx_bounce_end, *sfx_brick_break;
 
+enum {
+    ASSET_BALL,
+    ASSET_BALL_SQUASH,
+    ASSET_PLAYER,
+    ASSET_PLAYER_JUMP,
+    ASSET_PLAYER_FALL,
+    ASSET_BRICK,
+    ASSET_WHITE_NUMBERS,
+    ASSET_YELLOW_NUMBERS,
+    ASSET_GAME_OVER_TEXT,
+    ASSET_FPS_TEXT,
+    ASSET_SFX_JUMP,
+    ASSET_SFX_GAME_OVER,
+    ASSET_SFX_BOUNCE_START,
+    ASSET_SFX_BOUNCE_END,
+    ASSET_SFX_BRICK_BREAK,
+    NUM_ASSETS,
+};
+
+asset_t assets[NUM_ASSETS] = {
+    [ASSET_BALL] = {.path = "assets/ball3.png", .texture = &ball_texture},
+    [ASSET_BALL_SQUASH] = {.path = "assets/ball_squash.png", .texture = &ball_squash_texture},
+    [ASSET_PLAYER] = {.path = "assets/guy2.png", .texture = &player_texture},
+    [ASSET_PLAYER_JUMP] = {.path = "assets/guy2_jump.png", .texture = &player_jump_texture},
+    [ASSET_PLAYER_FALL] = {.path = "assets/guy2_fall.png", .texture = &player_fall_texture},
+    [ASSET_BRICK] = {.path = "assets/brick2.png", .texture = &brick_texture},
+    [ASSET_WHITE_NUMBERS] = {.path = "assets/white_numbers.png", .texture = &white_numbers_texture},
+    [ASSET_YELLOW_NUMBERS] = {.path = "assets/yellow_numbers.png", .texture = &yellow_numbers_texture},
+    [ASSET_GAME_OVER_TEXT] = {.path = "assets/game_over_text.png", .texture = &game_over_text_texture},
+    [ASSET_FPS_TEXT] = {.path = "assets/fps_text.png", .texture = &fps_text_texture},
+    [ASSET_SFX_JUMP] = {.path = "assets/jump.wav", .chunk = &sfx_jump},
+    [ASSET_SFX_GAME_OVER] = {.path = "assets/game_over.wav", .chunk = &sfx_game_over},
+    [ASSET_SFX_BOUNCE_START] = {.path = "assets/bounce_start.wav", .chunk = &sfx_bounce_start},
+    [ASSET_SFX_BOUNCE_END] = {.path = "assets/bounce_end.wav", .chunk = &sfx_bounce_end},
+    [ASSET_SFX_BRICK_BREAK] = {.path = "assets/kick3.wav", .chunk = &sfx_brick_break},
+};
+
 int glyph_width, glyph_height;
 int game_over_text_width, game_over_text_height;
 int fps_text_width, fps_text_height;
 
+#ifdef HOT_RELOAD
+bool hot_reload = false; // --watch-assets
+int assets_inotify = -1;
+#endif
+
+#ifdef TELEMETRY
+FILE *telemetry_file;
+SDL_Thread *telemetry_thread;
+SDL_atomic_t telemetry_stop;
+// Single producer (the game loop), single consumer (the flush thread). Both
+// counters only grow; their difference is the number of unflushed bytes.
+uint8_t telemetry_ring[TELEMETRY_RING_SIZE];
+SDL_atomic_t telemetry_head;
+SDL_atomic_t telemetry_tail;
+int32_t telemetry_last[TELEMETRY_NUM_FIELDS];
+uint32_t telemetry_tick;
+uint32_t telemetry_seed;
+bool telemetry_level_started;
+bool telemetry_need_sync;
+uint32_t telemetry_dropped;
+#endif
+
 bool should_quit = false;
 
 uint32_t frames = 0;
@@ -151,93 +470,295 @@ uint32_t fps = 0;
 
 bool show_fps = false;
 bool fullscreen = false;
+bool software_renderer = false;
+
+// The CPU renderer draws into framebuffer instead of through SDL_Renderer.
+// Headless runs have no window at all; the framebuffer is the only output.
+bool cpu_renderer = false;
+bool headless = false;
+const char *capture_path = NULL;
+uint32_t *framebuffer; // screen_width * screen_height, premultiplied ARGB8888
+SDL_Surface *framebuffer_surface;
+uint32_t *framebuffer_line; // scratch row for scaled blits
+
+// Triple buffer of render snapshots. The simulation writes one slot, the
+// renderer reads another, and render_snapshot_latest holds the index of the
+// third, which is the newest published.
+render_snapshot_t render_snapshots[3];
+SDL_atomic_t render_snapshot_latest = {2};
+int render_snapshot_write = 1; // simulation only
+int render_snapshot_read = 0;  // renderer only
+SDL_atomic_t render_snapshot_time; // SDL_GetTicks() at the last publish
+
+// Written by the main thread, read by the simulation.
+SDL_atomic_t sim_input;
+SDL_atomic_t sim_reset_requested;
+
+// EVENT_* flags whose sound effects are waiting for the main thread.
+SDL_atomic_t queued_sfx;
+
+#ifdef SIM_THREAD
+SDL_Thread *sim_thread;
+SDL_atomic_t sim_stop;
+SDL_sem *sim_wake; // posted whenever the simulation may have work again
+#endif
+SDL_atomic_t sim_paused;
 
-void init() {
-    gettimeofday(&tv, NULL);
-    srand((uint64_t)tv.tv_sec * 1000 + (uint64_t)tv.tv_usec / 1000);
-    float start_x = rand_range(128.0f, screen_width - 128.0f);
-    float start_y = 128.0f;
+// Window state, tracked from events. In the background, audio and (outside
+// versus mode) the simulation are paused.
+bool window_focused = true;
+bool window_minimized = false;
+bool page_hidden = false;
+bool paused = false;
 
-    ball = (body_t){
-        .px = start_x,
-        .py = start_y + player_height * 6.0f,
-    };
+// The snapshot on screen, kept to redraw after an expose or resize while
+// nothing new is published.
+const render_snapshot_t *shown_snapshot;
+bool redraw_needed = false;
 
-    player = (body_t){
-        .px = start_x - player_width * 0.5f,
-        .py = start_y + player_height * 2.0f,
-    };
+uint32_t bench_frames = 0;
+
+uint32_t level_seed;
+bool fixed_seed = false;
+
+// One arc per number of steps walked off the edge before jumping.
+jump_arc_t jump_arcs[MAX_COYOTE_STEPS];
+int num_jump_arcs;
+
+// Set while stepping anything other than the local player in real time.
+bool sfx_muted = false;
+
+bool versus = false;
+snapshot_t local_state, remote_state;
+
+#ifdef PROFILE
+const char *trace_path = "trace.json";
+bool dump_trace_pressed;
+
+profile_buffer_t *profile_buffers[PROFILE_MAX_THREADS];
+SDL_atomic_t profile_num_buffers;
+uint64_t profile_start_ticks;
+_Thread_local profile_buffer_t *profile_buffer;
+#endif
+
+#ifdef NETPLAY
+int net_socket = -1;
+struct sockaddr_in net_peer;
+bool net_connected;
+uint32_t net_seed;
+uint32_t net_delay;  // milliseconds
+float net_loss;      // probability
+uint32_t net_loss_state = 1;
+
+uint32_t net_frame;        // next step to simulate
+uint32_t remote_confirmed; // remote inputs for steps [0, remote_confirmed) are known
+uint32_t remote_ack;       // peer knows our inputs for steps [0, remote_ack)
+uint32_t rollback_from;
+uint32_t net_restart_step;    // latest step at which both clients restart, once scheduled
+uint32_t net_restart_steps[NET_HISTORY]; // by step, so rollbacks replay earlier restarts too
+uint32_t net_restart_checked; // steps [0, net_restart_checked) were checked for INPUT_RESTART
+uint32_t net_last_receive_time;
+SDL_atomic_t net_disconnected;
+
+// With --net-test, inputs are scripted and both simulations stop after
+// net_test_steps steps, so that two clients' results can be compared.
+uint32_t net_test_steps;
+uint32_t net_test_rng;
+uint8_t net_test_input;
+bool net_test_reported;
+
+uint8_t local_inputs[NET_HISTORY];
+uint8_t remote_inputs[NET_HISTORY]; // confirmed or predicted
+snapshot_t remote_history[NET_HISTORY]; // remote state at the start of each step
+
+net_packet_t net_queue[NET_QUEUE_SIZE];
+int net_queue_len;
+
+uint32_t num_rollbacks;
+uint32_t max_rollback_steps;
+uint64_t max_rollback_ticks;
+uint32_t num_stalls;
+#endif
+
+#ifdef PROFILE
+// Give the calling thread its own event buffer. Called implicitly by the first
+// zone recorded on a thread.
+void profile_thread(const char *name) {
+    if (profile_buffer != NULL) {
+        profile_buffer->thread_name = name;
+        return;
+    }
+    int index = SDL_AtomicAdd(&profile_num_buffers, 1);
+    if (index >= PROFILE_MAX_THREADS) {
+        return;
+    }
+    profile_buffer_t *buffer = calloc(1, sizeof(profile_buffer_t));
+    if (buffer == NULL) {
+        return;
+    }
+    buffer->thread_name = name;
+    profile_buffer = buffer;
+    SDL_AtomicSetPtr((void **)&profile_buffers[index], buffer);
+}
+
+void profile_record(const char *name, char phase) {
+    if (profile_buffer == NULL) {
+        profile_thread(NULL);
+        if (profile_buffer == NULL) {
+            return;
+        }
+    }
+    int head = SDL_AtomicGet(&profile_buffer->head);
+    profile_event_t *event = &profile_buffer->events[head & (PROFILE_RING_SIZE - 1)];
+    event->ticks = SDL_GetPerformanceCounter();
+    event->name = name;
+    event->phase = phase;
+    SDL_AtomicSet(&profile_buffer->head, head + 1);
+}
+
+void profile_zone_end(int *zone) {
+    (void)zone;
+    profile_record(NULL, 'E');
+}
+
+// Write the events still held by every thread's ring buffer as Chrome trace
+// event JSON, loadable in chrome://tracing or Perfetto.
+void profile_dump(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        perror(path);
+        return;
+    }
+    double us_per_tick = 1000000.0 / (double)SDL_GetPerformanceFrequency();
+    const char *separator = "";
+    fprintf(f, "{\"traceEvents\":[");
+    int num_buffers = SDL_AtomicGet(&profile_num_buffers);
+    for (int tid = 0; tid < num_buffers && tid < PROFILE_MAX_THREADS; tid++) {
+        profile_buffer_t *buffer = SDL_AtomicGetPtr((void **)&profile_buffers[tid]);
+        if (buffer == NULL) {
+            continue;
+        }
+        if (buffer->thread_name != NULL) {
+            fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                    separator, tid, buffer->thread_name);
+            separator = ",";
+        }
+        unsigned head = SDL_AtomicGet(&buffer->head);
+        unsigned first = head > PROFILE_RING_SIZE ? head - PROFILE_RING_SIZE : 0;
+        for (unsigned i = first; i < head; i++) {
+            const profile_event_t *event = &buffer->events[i & (PROFILE_RING_SIZE - 1)];
+            double ts = (double)(event->ticks - profile_start_ticks) * us_per_tick;
+            if (event->phase == 'B') {
+                fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"B\",\"ts\":%.3f,\"pid\":1,\"tid\":%d}", separator, event->name, ts, tid);
+            } else {
+                fprintf(f, "%s\n{\"ph\":\"E\",\"ts\":%.3f,\"pid\":1,\"tid\":%d}", separator, ts, tid);
+            }
+            separator = ",";
+        }
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+    printf("wrote %s\n", path);
+}
+#endif
+
+// Lay out the clusters of three bricks that make up the level for seed and
+// return the x coordinate of the starting cluster's center. Each cluster is
+// placed relative to the previous one, so level[i] and level[i + 3] belong to
+// consecutive clusters.
+float generate_level(uint32_t seed, brick_t *level) {
+    uint32_t state = seed;
+    uint32_t *rng = &state;
+    float start_x = rand_range(rng, 128.0f, screen_width - 128.0f);
+    float start_y = 128.0f;
 
-    memset(bricks, 0, MAX_NUM_BRICKS * sizeof(brick_t));
+    memset(level, 0, MAX_NUM_BRICKS * sizeof(brick_t));
 
-    bricks[0].x = start_x - brick_width / 2.0f;
-    bricks[0].y = start_y;
-    bricks[1].x = start_x - brick_width * 3.0f / 2.0f;
-    bricks[1].y = start_y;
-    bricks[2].x = start_x + brick_width / 2.0f;
-    bricks[2].y = start_y;
+    level[0].x = start_x - brick_width / 2.0f;
+    level[0].y = start_y;
+    level[1].x = start_x - brick_width * 3.0f / 2.0f;
+    level[1].y = start_y;
+    level[2].x = start_x + brick_width / 2.0f;
+    level[2].y = start_y;
 
     float last_x = start_x;
     float last_y = start_y;
 
     {
         int i = 3;
-        float x = rand_range(start_x + 3.0f * brick_width, start_x + 6.0f * brick_width);
-        float y = last_y + rand_range(1.5f * player_height, 2.0f * player_height);
+        float x = rand_range(rng, start_x + 3.0f * brick_width, start_x + 6.0f * brick_width);
+        float y = last_y + rand_range(rng, 1.5f * player_height, 2.0f * player_height);
         last_x = x;
         last_y = y;
-        bricks[i].x = last_x - brick_width / 2.0f;
-        bricks[i].y = last_y;
-        bricks[i + 1].x = last_x - brick_width * 3.0f / 2.0f;
-        bricks[i + 1].y = last_y;
-        bricks[i + 2].x = last_x + brick_width / 2.0f;
-        bricks[i + 2].y = last_y;
+        level[i].x = last_x - brick_width / 2.0f;
+        level[i].y = last_y;
+        level[i + 1].x = last_x - brick_width * 3.0f / 2.0f;
+        level[i + 1].y = last_y;
+        level[i + 2].x = last_x + brick_width / 2.0f;
+        level[i + 2].y = last_y;
     }
 
     {
         int i = 6;
-        float x = rand_range(start_x - 9.0f * brick_width, start_x - 6.0f * brick_width);
-        float y = last_y + rand_range(1.5f * player_height, 2.0f * player_height);
+        float x = rand_range(rng, start_x - 9.0f * brick_width, start_x - 6.0f * brick_width);
+        float y = last_y + rand_range(rng, 1.5f * player_height, 2.0f * player_height);
         last_x = x;
         last_y = y;
-        bricks[i].x = last_x - brick_width / 2.0f;
-        bricks[i].y = last_y;
-        bricks[i + 1].x = last_x - brick_width * 3.0f / 2.0f;
-        bricks[i + 1].y = last_y;
-        bricks[i + 2].x = last_x + brick_width / 2.0f;
-        bricks[i + 2].y = last_y;
+        level[i].x = last_x - brick_width / 2.0f;
+        level[i].y = last_y;
+        level[i + 1].x = last_x - brick_width * 3.0f / 2.0f;
+        level[i + 1].y = last_y;
+        level[i + 2].x = last_x + brick_width / 2.0f;
+        level[i + 2].y = last_y;
     }
 
     {
         int i = 9;
-        float x = rand_range(start_x + 6.0f * brick_width, start_x + 9.0f * brick_width);
-        float y = last_y + rand_range(1.5f * player_height, 2.0f * player_height);
+        float x = rand_range(rng, start_x + 6.0f * brick_width, start_x + 9.0f * brick_width);
+        float y = last_y + rand_range(rng, 1.5f * player_height, 2.0f * player_height);
         last_x = x;
         last_y = y;
-        bricks[i].x = last_x - brick_width / 2.0f;
-        bricks[i].y = last_y;
-        bricks[i + 1].x = last_x - brick_width * 3.0f / 2.0f;
-        bricks[i + 1].y = last_y;
-        bricks[i + 2].x = last_x + brick_width / 2.0f;
-        bricks[i + 2].y = last_y;
+        level[i].x = last_x - brick_width / 2.0f;
+        level[i].y = last_y;
+        level[i + 1].x = last_x - brick_width * 3.0f / 2.0f;
+        level[i + 1].y = last_y;
+        level[i + 2].x = last_x + brick_width / 2.0f;
+        level[i + 2].y = last_y;
     }
 
     for (int i = 12; i < 255; i += 3) {
-        float x = rand_range(0.0f, 1.0f) > 0.5f ? rand_range(last_x + 3.0f * brick_width, last_x + 6.0f * brick_width) : rand_range(last_x - 9.0f * brick_width, last_x - 6.0f * brick_width);
-        float y = last_y + rand_range(1.5f * player_height, 2.0f * player_height);
+        float x = rand_range(rng, 0.0f, 1.0f) > 0.5f ? rand_range(rng, last_x + 3.0f * brick_width, last_x + 6.0f * brick_width) : rand_range(rng, last_x - 9.0f * brick_width, last_x - 6.0f * brick_width);
+        float y = last_y + rand_range(rng, 1.5f * player_height, 2.0f * player_height);
         last_x = x;
         last_y = y;
-        bricks[i].x = last_x - brick_width / 2.0f;
-        bricks[i].y = last_y;
-        bricks[i + 1].x = last_x - brick_width * 3.0f / 2.0f;
-        bricks[i + 1].y = last_y;
-        bricks[i + 2].x = last_x + brick_width / 2.0f;
-        bricks[i + 2].y = last_y;
+        level[i].x = last_x - brick_width / 2.0f;
+        level[i].y = last_y;
+        level[i + 1].x = last_x - brick_width * 3.0f / 2.0f;
+        level[i + 1].y = last_y;
+        level[i + 2].x = last_x + brick_width / 2.0f;
+        level[i + 2].y = last_y;
     }
 
+    return start_x;
+}
+
+void init_seeded(uint32_t seed) {
+    level_seed = seed;
+    float start_x = generate_level(seed, bricks);
+    float start_y = bricks[0].y;
+
+    ball = (body_t){
+        .px = start_x,
+        .py = start_y + player_height * 6.0f,
+    };
+
+    player = (body_t){
+        .px = start_x - player_width * 0.5f,
+        .py = start_y + player_height * 2.0f,
+    };
+
     next_brick = 0;
 
-    last_fps_update_time = 0;
     last_ball_px = 0.0f;
     last_ball_py = 0.0f;
     last_player_px = 0.0f;
@@ -246,8 +767,6 @@ void init() {
     left_pressed = false;
     right_pressed = false;
     down_pressed = false;
-    show_fps_pressed = false;
-    toggle_fullscreen_pressed = false;
     player_on_ground = false;
     player_carrying_ball = false;
     player_jumping = false;
@@ -277,38 +796,376 @@ void init() {
     score = 0;
 }
 
-void one_iter() {
-    SDL_Event e;
-    if (SDL_PollEvent(&e)) {
-        if (e.type == SDL_QUIT) {
-            should_quit = true;
-            return;
+void init() {
+    if (!fixed_seed) {
+        gettimeofday(&tv, NULL);
+        level_seed = (uint64_t)tv.tv_sec * 1000 + (uint64_t)tv.tv_usec / 1000;
+    }
+    init_seeded(level_seed);
+#ifdef TELEMETRY
+    telemetry_start_level(level_seed);
+#endif
+}
+
+// Trace the player's jump with the same integration as step(): running at
+// player_max_velocity, optionally walking off the edge for up to
+// coyote_time - 1 steps before jumping.
+void init_jump_arcs() {
+    num_jump_arcs = coyote_time < MAX_COYOTE_STEPS ? coyote_time : MAX_COYOTE_STEPS;
+    for (int k = 0; k < num_jump_arcs; k++) {
+        jump_arc_t *arc = &jump_arcs[k];
+        body_t body = {.vx = player_max_velocity};
+        arc->px[0] = 0.0f;
+        arc->py[0] = 0.0f;
+        arc->len = 1;
+        arc->jump_step = k + 1;
+        arc->apex = 0;
+        for (int s = 1; s < MAX_JUMP_ARC_STEPS; s++) {
+            if (s == arc->jump_step) {
+                body.vy = player_jump_velocity;
+            }
+            body.vy -= seconds_per_frame * gravity;
+            body.px += seconds_per_frame * body.vx;
+            body.py += seconds_per_frame * body.vy;
+            arc->px[s] = body.px;
+            arc->py[s] = body.py;
+            arc->len++;
+            if (body.py > arc->py[arc->apex]) {
+                arc->apex = s;
+            }
+            if (body.py < -player_max_jump_height) {
+                break;
+            }
         }
     }
+}
 
-    frames++;
-    uint32_t ticks = SDL_GetTicks();
-    uint32_t delta = ticks - last_fps_update_time;
-    if (delta > 200) {
-        fps = (float)frames / (float)delta * 1000.0f;
-        last_fps_update_time = ticks;
-        frames = 0;
+// Return the furthest horizontal distance the player can cover while landing
+// on a brick top dy above the one it jumped from, or -INFINITY if it is out of
+// reach. Landing uses the same test as the player/brick collision in step().
+// Shorter distances are always reachable by holding back.
+float jump_reach(float dy) {
+    float reach = -INFINITY;
+    for (int k = 0; k < num_jump_arcs; k++) {
+        const jump_arc_t *arc = &jump_arcs[k];
+        // Falling while walking off the edge.
+        for (int s = 1; s < arc->jump_step; s++) {
+            if (arc->py[s - 1] + 0.001f > dy && arc->py[s] <= dy) {
+                reach = fmax(reach, arc->px[s]);
+            }
+        }
+        // Past the apex the arc only falls, so the landing step can be found
+        // by bisection.
+        int lo = arc->apex + 1;
+        int hi = arc->len;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (arc->py[mid] <= dy) {
+                hi = mid;
+            } else {
+                lo = mid + 1;
+            }
+        }
+        if (lo < arc->len && arc->py[lo - 1] + 0.001f > dy) {
+            reach = fmax(reach, arc->px[lo]);
+        }
     }
+    return reach;
+}
 
-    const Uint8 *keystates = SDL_GetKeyboardState(NULL);
-    left_pressed = keystates[SDL_SCANCODE_A] || keystates[SDL_SCANCODE_LEFT];
-    right_pressed = keystates[SDL_SCANCODE_D] || keystates[SDL_SCANCODE_RIGHT];
-    down_pressed = keystates[SDL_SCANCODE_S] || keystates[SDL_SCANCODE_DOWN];
+// Check that every cluster can be reached from the one below it, taking the
+// horizontal wrap into account. init_jump_arcs() must have been called.
+bool check_level_reachable(const brick_t *level) {
+    for (int i = 3; i + 2 < MAX_NUM_BRICKS; i += 3) {
+        const brick_t *from = &level[i - 3];
+        const brick_t *to = &level[i];
+        if (to->x == 0 && to->y == 0) {
+            break;
+        }
+        float dx = positive_fmod(to->x - from->x, (float)screen_width);
+        float distance = fmin(dx, screen_width - dx);
+        // Gap between the player's edge when leaving one cluster and its edge
+        // when first touching the next.
+        float gap = distance - 3.0f * brick_width - player_width;
+        if (jump_reach(to->y - from->y) < gap) {
+            return false;
+        }
+    }
+    return true;
+}
 
-    if (!reset_pressed && keystates[SDL_SCANCODE_R]) {
-        reset_pressed = keystates[SDL_SCANCODE_R];
-        init();
+int validate_seeds_thread(void *data) {
+    PROFILE_THREAD("validate");
+    PROFILE_ZONE("validate seeds");
+    validate_job_t *job = data;
+    brick_t level[MAX_NUM_BRICKS];
+    for (uint32_t i = 0; i < job->num_seeds; i++) {
+        generate_level(job->first_seed + i, level);
+        if (check_level_reachable(level)) {
+            job->bits[i / 8] |= 1 << (i % 8);
+            job->num_good++;
+        }
+    }
+    return 0;
+}
+
+void put_u32(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+uint32_t get_u32(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// Generate and check num_seeds levels starting at first_seed on every core,
+// then write a seed index to path: a header (magic, first seed, number of
+// seeds) followed by one bit per seed, set if the level is reachable.
+int validate_seeds(uint32_t first_seed, uint32_t num_seeds, const char *path) {
+    if (num_seeds == 0 || num_seeds - 1 > UINT32_MAX - first_seed) {
+        fprintf(stderr, "%u seeds starting at %u are out of range\n", num_seeds, first_seed);
+        return EXIT_FAILURE;
+    }
+    init_jump_arcs();
+
+    int num_threads = SDL_GetCPUCount();
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+    uint32_t num_bytes = ((uint64_t)num_seeds + 7) / 8;
+    uint8_t *index = calloc((size_t)SEED_INDEX_HEADER_SIZE + num_bytes, 1);
+    validate_job_t *jobs = calloc(num_threads, sizeof(validate_job_t));
+    SDL_Thread **threads = calloc(num_threads, sizeof(SDL_Thread *));
+    if (index == NULL || jobs == NULL || threads == NULL) {
+        fprintf(stderr, "out of memory\n");
+        free(threads);
+        free(jobs);
+        free(index);
+        return EXIT_FAILURE;
+    }
+    put_u32(&index[0], SEED_INDEX_MAGIC);
+    put_u32(&index[4], first_seed);
+    put_u32(&index[8], num_seeds);
+
+    uint32_t start = SDL_GetTicks();
+    // Split on byte boundaries so that no two threads write the same byte.
+    uint32_t bytes_per_thread = (num_bytes + num_threads - 1) / num_threads;
+    for (int t = 0; t < num_threads; t++) {
+        uint32_t first_byte = t * bytes_per_thread < num_bytes ? t * bytes_per_thread : num_bytes;
+        uint32_t last_byte = first_byte + bytes_per_thread < num_bytes ? first_byte + bytes_per_thread : num_bytes;
+        uint32_t first = (uint64_t)first_byte * 8 < num_seeds ? first_byte * 8 : num_seeds;
+        uint32_t last = (uint64_t)last_byte * 8 < num_seeds ? last_byte * 8 : num_seeds;
+        jobs[t] = (validate_job_t){
+            .first_seed = first_seed + first,
+            .num_seeds = last - first,
+            .bits = &index[SEED_INDEX_HEADER_SIZE + first_byte],
+        };
+        threads[t] = SDL_CreateThread(validate_seeds_thread, "validate", &jobs[t]);
+        if (threads[t] == NULL) {
+            validate_seeds_thread(&jobs[t]);
+        }
+    }
+    uint32_t num_good = 0;
+    for (int t = 0; t < num_threads; t++) {
+        if (threads[t] != NULL) {
+            SDL_WaitThread(threads[t], NULL);
+        }
+        num_good += jobs[t].num_good;
+    }
+    uint32_t elapsed = SDL_GetTicks() - start;
+
+    int result = EXIT_FAILURE;
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        perror(path);
+    } else if (fwrite(index, 1, SEED_INDEX_HEADER_SIZE + num_bytes, f) != SEED_INDEX_HEADER_SIZE + num_bytes) {
+        fprintf(stderr, "%s: short write\n", path);
+        fclose(f);
+    } else if (fclose(f) != 0) {
+        perror(path);
+    } else {
+        printf("%u of %u seeds reachable, %u threads, %u ms\n", num_good, num_seeds, num_threads, elapsed);
+        result = EXIT_SUCCESS;
+    }
+
+    free(threads);
+    free(jobs);
+    free(index);
+    return result;
+}
+
+// Pick today's seed from a seed index written by validate_seeds().
+bool pick_daily_seed(const char *path, uint32_t *seed) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        return false;
+    }
+    uint8_t header[SEED_INDEX_HEADER_SIZE];
+    if (fread(header, 1, sizeof(header), f) != sizeof(header) || get_u32(&header[0]) != SEED_INDEX_MAGIC) {
+        fprintf(stderr, "%s is not a seed index\n", path);
+        fclose(f);
+        return false;
+    }
+    uint32_t first_seed = get_u32(&header[4]);
+    uint32_t num_seeds = get_u32(&header[8]);
+    // Check the bitmap's size against the file before trusting the header.
+    uint32_t num_bytes = ((uint64_t)num_seeds + 7) / 8;
+    long file_size = fseek(f, 0, SEEK_END) == 0 ? ftell(f) : -1;
+    if (num_seeds == 0 || file_size != (long)SEED_INDEX_HEADER_SIZE + (long)num_bytes || fseek(f, SEED_INDEX_HEADER_SIZE, SEEK_SET) != 0) {
+        fprintf(stderr, "%s is truncated or corrupt\n", path);
+        fclose(f);
+        return false;
+    }
+    uint8_t *bits = malloc(num_bytes);
+    if (bits == NULL || fread(bits, 1, num_bytes, f) != num_bytes) {
+        fprintf(stderr, "%s is truncated\n", path);
+        free(bits);
+        fclose(f);
+        return false;
+    }
+    fclose(f);
+
+    uint32_t num_good = 0;
+    for (uint32_t i = 0; i < num_seeds; i++) {
+        num_good += (bits[i / 8] >> (i % 8)) & 1;
+    }
+    if (num_good == 0) {
+        fprintf(stderr, "%s has no reachable seeds\n", path);
+        free(bits);
+        return false;
+    }
+
+    gettimeofday(&tv, NULL);
+    uint32_t n = (uint32_t)(tv.tv_sec / 86400) % num_good;
+    for (uint32_t i = 0; i < num_seeds; i++) {
+        if ((bits[i / 8] >> (i % 8)) & 1) {
+            if (n == 0) {
+                *seed = first_seed + i;
+                break;
+            }
+            n--;
+        }
+    }
+    free(bits);
+    return true;
+}
+
+void save_state(snapshot_t *s) {
+    s->ball = ball;
+    s->player = player;
+    memcpy(s->bricks, bricks, sizeof(bricks));
+    s->last_ball_px = last_ball_px;
+    s->last_ball_py = last_ball_py;
+    s->last_player_px = last_player_px;
+    s->last_player_py = last_player_py;
+    s->player_carry_offset = player_carry_offset;
+    s->stored_ball_vx = stored_ball_vx;
+    s->stored_ball_vy = stored_ball_vy;
+    s->stored_ball_py = stored_ball_py;
+    s->camera_y = camera_y;
+    s->camera_focus_y = camera_focus_y;
+    s->ball_carry_time = ball_carry_time;
+    s->ball_bounce_time = ball_bounce_time;
+    s->air_time = air_time;
+    s->jump_time = jump_time;
+    s->time_since_jump_press = time_since_jump_press;
+    s->time_since_jump_release = time_since_jump_release;
+    s->score = score;
+    s->player_brick = player_brick == NULL ? -1 : player_brick - bricks;
+    s->hit_brick = hit_brick == NULL ? -1 : hit_brick - bricks;
+    s->left_pressed = left_pressed;
+    s->right_pressed = right_pressed;
+    s->down_pressed = down_pressed;
+    s->jump_pressed = jump_pressed;
+    s->player_on_ground = player_on_ground;
+    s->player_carrying_ball = player_carrying_ball;
+    s->player_jumping = player_jumping;
+    s->ball_bouncing = ball_bouncing;
+    s->left_pressed_entering_carry_state = left_pressed_entering_carry_state;
+    s->right_pressed_entering_carry_state = right_pressed_entering_carry_state;
+    s->game_over = game_over;
+}
+
+void load_state(const snapshot_t *s) {
+    ball = s->ball;
+    player = s->player;
+    memcpy(bricks, s->bricks, sizeof(bricks));
+    last_ball_px = s->last_ball_px;
+    last_ball_py = s->last_ball_py;
+    last_player_px = s->last_player_px;
+    last_player_py = s->last_player_py;
+    player_carry_offset = s->player_carry_offset;
+    stored_ball_vx = s->stored_ball_vx;
+    stored_ball_vy = s->stored_ball_vy;
+    stored_ball_py = s->stored_ball_py;
+    camera_y = s->camera_y;
+    camera_focus_y = s->camera_focus_y;
+    ball_carry_time = s->ball_carry_time;
+    ball_bounce_time = s->ball_bounce_time;
+    air_time = s->air_time;
+    jump_time = s->jump_time;
+    time_since_jump_press = s->time_since_jump_press;
+    time_since_jump_release = s->time_since_jump_release;
+    score = s->score;
+    player_brick = s->player_brick < 0 ? NULL : &bricks[s->player_brick];
+    hit_brick = s->hit_brick < 0 ? NULL : &bricks[s->hit_brick];
+    left_pressed = s->left_pressed;
+    right_pressed = s->right_pressed;
+    down_pressed = s->down_pressed;
+    jump_pressed = s->jump_pressed;
+    player_on_ground = s->player_on_ground;
+    player_carrying_ball = s->player_carrying_ball;
+    player_jumping = s->player_jumping;
+    ball_bouncing = s->ball_bouncing;
+    left_pressed_entering_carry_state = s->left_pressed_entering_carry_state;
+    right_pressed_entering_carry_state = s->right_pressed_entering_carry_state;
+    game_over = s->game_over;
+}
+
+// Queue the sound effect for event. The main thread plays it, since it owns
+// the loaded chunks and may replace them on hot reload.
+void play_sfx(uint8_t event) {
+    if (sfx_muted) {
         return;
-    } else if (reset_pressed && !keystates[SDL_SCANCODE_R]) {
-        reset_pressed = keystates[SDL_SCANCODE_R];
     }
+    int queued;
+    do {
+        queued = SDL_AtomicGet(&queued_sfx);
+    } while (!SDL_AtomicCAS(&queued_sfx, queued, queued | event));
+}
+
+void play_queued_sfx() {
+    uint8_t events = SDL_AtomicSet(&queued_sfx, 0);
+    if (events & EVENT_JUMP) {
+        Mix_PlayChannel(-1, sfx_jump, 0);
+    }
+    if (events & EVENT_BOUNCE_START) {
+        Mix_PlayChannel(-1, sfx_bounce_start, 0);
+    }
+    if (events & EVENT_BOUNCE_END) {
+        Mix_PlayChannel(-1, sfx_bounce_end, 0);
+    }
+    if (events & EVENT_BRICK_BREAK) {
+        Mix_PlayChannel(-1, sfx_brick_break, 0);
+    }
+    if (events & EVENT_GAME_OVER) {
+        Mix_PlayChannel(-1, sfx_game_over, 0);
+    }
+}
 
-    bool jump_keystates = keystates[SDL_SCANCODE_SPACE] || keystates[SDL_SCANCODE_W];
+// Advance the simulation by one step. Everything read or written here is part
+// of snapshot_t, so a step can be rewound with load_state() and replayed.
+void step(uint8_t input) {
+    PROFILE_ZONE("step");
+    tick_events = 0;
+    left_pressed = input & INPUT_LEFT;
+    right_pressed = input & INPUT_RIGHT;
+    down_pressed = input & INPUT_DOWN;
+
+    bool jump_keystates = input & INPUT_JUMP;
     if (!jump_pressed && jump_keystates) {
         jump_pressed = jump_keystates;
         time_since_jump_press = 0;
@@ -317,32 +1174,12 @@ void one_iter() {
         time_since_jump_release = 0;
     }
 
-    bool show_fps_keystates = keystates[SDL_SCANCODE_P];
-    if (!show_fps_pressed && show_fps_keystates) {
-        show_fps_pressed = true;
-        show_fps = !show_fps;
-    } else if (show_fps_pressed && !show_fps_keystates) {
-        show_fps_pressed = false;
-    }
-
-    bool toggle_fullscreen_keystates = keystates[SDL_SCANCODE_F];
-    if (!toggle_fullscreen_pressed && toggle_fullscreen_keystates) {
-        toggle_fullscreen_pressed = true;
-        fullscreen = !fullscreen;
-        if (fullscreen) {
-            SDL_SetWindowFullscreen(win, SDL_WINDOW_FULLSCREEN_DESKTOP);
-        } else {
-            SDL_SetWindowFullscreen(win, 0);
-        }
-    } else if (toggle_fullscreen_pressed && !toggle_fullscreen_keystates) {
-        toggle_fullscreen_pressed = false;
-    }
-
     if (game_over) {
         return;
     }
 
     // Step player.
+    PROFILE_BEGIN("player step");
     last_player_px = player.px;
     last_player_py = player.py;
     if (left_pressed ^ right_pressed) {
@@ -373,7 +1210,8 @@ void one_iter() {
             // Player is able to jump.
             player.vy = player_jump_velocity;
             player_jumping = true;
-            Mix_PlayChannel(-1, sfx_jump, 0);
+            tick_events |= EVENT_JUMP;
+            play_sfx(EVENT_JUMP);
         }
     }
     if (jump_time > time_to_max_jump) {
@@ -388,7 +1226,10 @@ void one_iter() {
     player.px += seconds_per_frame * player.vx;
     player.py += seconds_per_frame * player.vy;
 
+    PROFILE_END();
+
     // Step ball.
+    PROFILE_BEGIN("ball step");
     last_ball_px = ball.px;
     last_ball_py = ball.py;
     // Squash ball.
@@ -420,7 +1261,8 @@ void one_iter() {
             left_pressed_entering_carry_state = false;
             player_carrying_ball = false;
             ball_carry_time = 0;
-            Mix_PlayChannel(-1, sfx_bounce_end, 0);
+            tick_events |= EVENT_BOUNCE_END;
+            play_sfx(EVENT_BOUNCE_END);
         }
     } else if (ball_bouncing) {
         if (ball_bounce_time < time_to_squash) {
@@ -435,11 +1277,9 @@ void one_iter() {
             hit_brick->x = 0;
             hit_brick->y = 0;
             hit_brick = NULL;
-            Mix_PlayChannel(-1, sfx_brick_break, 0);
+            tick_events |= EVENT_BRICK_BREAK;
+            play_sfx(EVENT_BRICK_BREAK);
             score++;
-            if (score > high_score) {
-                high_score = score;
-            }
         }
     } else {
         ball.vy -= seconds_per_frame * gravity;
@@ -450,10 +1290,14 @@ void one_iter() {
     // Check if ball falls off the bottom of screen.
     if (ball.py + ball_radius < camera_y) {
         game_over = true;
-        Mix_PlayChannel(-1, sfx_game_over, 0);
+        tick_events |= EVENT_GAME_OVER;
+        play_sfx(EVENT_GAME_OVER);
     }
 
+    PROFILE_END();
+
     // Check for collision between ball and player.
+    PROFILE_BEGIN("collision");
     if (!player_carrying_ball) {
         bool collision =
             check_collision_circle_rect(positive_fmod(ball.px, (float)screen_width), ball.py, ball_radius,
@@ -476,14 +1320,13 @@ void one_iter() {
                 hit_brick->x = 0;
                 hit_brick->y = 0;
                 hit_brick = NULL;
-                Mix_PlayChannel(-1, sfx_brick_break, 0);
+                tick_events |= EVENT_BRICK_BREAK;
+                play_sfx(EVENT_BRICK_BREAK);
                 score++;
-                if (score > high_score) {
-                    high_score = score;
-                }
             }
 
-            Mix_PlayChannel(-1, sfx_bounce_start, 0);
+            tick_events |= EVENT_BOUNCE_START;
+            play_sfx(EVENT_BOUNCE_START);
         }
     }
 
@@ -515,7 +1358,8 @@ void one_iter() {
                 ball.vy = 0.0f;
                 stored_ball_py = ball.py;
                 hit_brick = brick;
-                Mix_PlayChannel(-1, sfx_bounce_start, 0);
+                tick_events |= EVENT_BOUNCE_START;
+                play_sfx(EVENT_BOUNCE_START);
             }
         }
         {
@@ -540,11 +1384,15 @@ void one_iter() {
         player_on_ground = false;
     }
 
+    PROFILE_END();
+
     // Move camera.
+    PROFILE_BEGIN("camera");
     float camera_target_y = camera_focus_y - camera_focus_bottom_margin;
     if (fabs(camera_y - camera_target_y) > 0.001f) {
         camera_y = (1.0f - camera_move_factor) * camera_y + camera_move_factor * camera_target_y;
     }
+    PROFILE_END();
 
     // Increment counters.
     if (!player_on_ground) {
@@ -562,208 +1410,1667 @@ void one_iter() {
     if (time_since_jump_release < max_time - 1) {
         time_since_jump_release++;
     }
+}
 
-    // Render.
-    SDL_RenderClear(renderer);
-    for (int i = 0; i < MAX_NUM_BRICKS; i++) {
-        brick_t *brick = &bricks[i];
-        if (brick->x == 0 && brick->y == 0) {
-            continue;
-        }
-        SDL_Rect dst_rect = {.x = (int)brick->x, .y = screen_height - (int)(brick->y + brick_height - camera_y), .w = (int)brick_width, .h = (int)brick_height};
-        dst_rect.x = positive_fmod(dst_rect.x, screen_width);
-        SDL_Rect wrap_rect = dst_rect;
-        wrap_rect.x -= screen_width;
-        SDL_RenderCopy(renderer, brick_texture, NULL, &dst_rect);
-        SDL_RenderCopy(renderer, brick_texture, NULL, &wrap_rect);
+bool init_framebuffer() {
+    framebuffer = calloc(screen_width * screen_height, sizeof(uint32_t));
+    framebuffer_line = calloc(screen_width, sizeof(uint32_t));
+    if (framebuffer == NULL || framebuffer_line == NULL) {
+        return false;
     }
-    {
-        SDL_Rect dst_rect = {.x = (int)(ball.px - ball_radius), .y = screen_height - (int)(ball.py + ball_radius - camera_y), .w = (int)(ball_radius * 2), .h = (int)(ball_radius * 2)};
-        if (player_carrying_ball || ball_bouncing) {
-            const int ball_squash_width = 2.0f * ball_radius + 4.0f * 4.0f;
-            float x = ball.px - (float)ball_squash_width / 2.0f;
-            dst_rect.w = ball_squash_width;
-            dst_rect.x = x;
-        }
-        dst_rect.x = positive_fmod(dst_rect.x, screen_width);
-        SDL_Rect wrap_rect = dst_rect;
-        wrap_rect.x -= screen_width;
-        if (player_carrying_ball || ball_bouncing) {
-            SDL_RenderCopy(renderer, ball_squash_texture, NULL, &dst_rect);
-            SDL_RenderCopy(renderer, ball_squash_texture, NULL, &wrap_rect);
-        } else {
-            SDL_RenderCopy(renderer, ball_texture, NULL, &dst_rect);
-            SDL_RenderCopy(renderer, ball_texture, NULL, &wrap_rect);
+    framebuffer_surface = SDL_CreateRGBSurfaceWithFormatFrom(framebuffer, screen_width, screen_height, 32,
+                                                             screen_width * sizeof(uint32_t), SDL_PIXELFORMAT_ARGB8888);
+    if (framebuffer_surface == NULL) {
+        return false;
+    }
+    SDL_SetSurfaceBlendMode(framebuffer_surface, SDL_BLENDMODE_NONE);
+    return true;
+}
+
+void free_framebuffer() {
+    if (framebuffer_surface != NULL) {
+        SDL_FreeSurface(framebuffer_surface);
+        framebuffer_surface = NULL;
+    }
+    free(framebuffer_line);
+    free(framebuffer);
+    framebuffer_line = NULL;
+    framebuffer = NULL;
+}
+
+// Write the framebuffer as a binary PPM.
+bool save_framebuffer(const char *path) {
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        perror(path);
+        return false;
+    }
+    fprintf(f, "P6\n%u %u\n255\n", screen_width, screen_height);
+    for (uint32_t y = 0; y < screen_height; y++) {
+        uint8_t row[3 * screen_width];
+        for (uint32_t x = 0; x < screen_width; x++) {
+            uint32_t p = framebuffer[y * screen_width + x];
+            row[3 * x] = p >> 16;
+            row[3 * x + 1] = p >> 8;
+            row[3 * x + 2] = p;
         }
+        fwrite(row, 1, sizeof(row), f);
     }
-    {
-        SDL_Rect dst_rect = {.x = (int)player.px, .y = screen_height - (int)(player.py + player_height - camera_y), .w = (int)player_width, .h = (int)player_height};
+    fclose(f);
+    return true;
+}
+
+// dst = src + dst * (255 - src alpha) / 255 for n premultiplied pixels.
+void blend_row(uint32_t *dst, const uint32_t *src, int n) {
+    int i = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i all_255 = _mm_set1_epi16(255);
+    const __m128i round = _mm_set1_epi16(128);
+    for (; i + 4 <= n; i += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        int opaque = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_srai_epi32(s, 24), _mm_set1_epi32(-1)));
+        if (opaque == 0xffff) {
+            _mm_storeu_si128((__m128i *)(dst + i), s);
+            continue;
+        }
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_srli_epi32(s, 24), zero)) == 0xffff) {
+            continue;
+        }
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+
+        __m128i s_lo = _mm_unpacklo_epi8(s, zero);
+        __m128i s_hi = _mm_unpackhi_epi8(s, zero);
+        __m128i d_lo = _mm_unpacklo_epi8(d, zero);
+        __m128i d_hi = _mm_unpackhi_epi8(d, zero);
+
+        // Broadcast each pixel's alpha to its four 16-bit channels.
+        __m128i a_lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_lo, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+        __m128i a_hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_hi, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+
+        // x / 255 == (x + 128 + ((x + 128) >> 8)) >> 8 for x in [0, 255 * 255].
+        __m128i t_lo = _mm_add_epi16(_mm_mullo_epi16(d_lo, _mm_sub_epi16(all_255, a_lo)), round);
+        __m128i t_hi = _mm_add_epi16(_mm_mullo_epi16(d_hi, _mm_sub_epi16(all_255, a_hi)), round);
+        t_lo = _mm_srli_epi16(_mm_add_epi16(t_lo, _mm_srli_epi16(t_lo, 8)), 8);
+        t_hi = _mm_srli_epi16(_mm_add_epi16(t_hi, _mm_srli_epi16(t_hi, 8)), 8);
+
+        __m128i out = _mm_packus_epi16(_mm_add_epi16(s_lo, t_lo), _mm_add_epi16(s_hi, t_hi));
+        _mm_storeu_si128((__m128i *)(dst + i), out);
+    }
+#endif
+    for (; i < n; i++) {
+        uint32_t s = src[i];
+        uint32_t ia = 255 - (s >> 24);
+        uint32_t d = dst[i];
+        uint32_t rb = (d & 0x00ff00ff) * ia + 0x00800080;
+        uint32_t ag = ((d >> 8) & 0x00ff00ff) * ia + 0x00800080;
+        rb = ((rb + ((rb >> 8) & 0x00ff00ff)) >> 8) & 0x00ff00ff;
+        ag = (ag + ((ag >> 8) & 0x00ff00ff)) & 0xff00ff00;
+        dst[i] = s + (rb | ag);
+    }
+}
+
+// Scale n premultiplied pixels by alpha / 255.
+void fade_row(uint32_t *row, int n, uint8_t alpha) {
+    for (int i = 0; i < n; i++) {
+        uint32_t p = row[i];
+        uint32_t rb = (p & 0x00ff00ff) * alpha + 0x00800080;
+        uint32_t ag = ((p >> 8) & 0x00ff00ff) * alpha + 0x00800080;
+        rb = ((rb + ((rb >> 8) & 0x00ff00ff)) >> 8) & 0x00ff00ff;
+        ag = (ag + ((ag >> 8) & 0x00ff00ff)) & 0xff00ff00;
+        row[i] = rb | ag;
+    }
+}
+
+// Nearest-neighbour blit with the same clipping and scaling as SDL_RenderCopy
+// at the logical resolution.
+void blit_sprite(const SDL_Surface *sprite, const SDL_Rect *src, const SDL_Rect *dst, uint8_t alpha) {
+    SDL_Rect s = src != NULL ? *src : (SDL_Rect){0, 0, sprite->w, sprite->h};
+    if (dst->w <= 0 || dst->h <= 0 || s.w <= 0 || s.h <= 0) {
+        return;
+    }
+    int x0 = dst->x < 0 ? 0 : dst->x;
+    int y0 = dst->y < 0 ? 0 : dst->y;
+    int x1 = dst->x + dst->w > (int)screen_width ? (int)screen_width : dst->x + dst->w;
+    int y1 = dst->y + dst->h > (int)screen_height ? (int)screen_height : dst->y + dst->h;
+    if (x0 >= x1 || y0 >= y1) {
+        return;
+    }
+    int n = x1 - x0;
+    bool unscaled = s.w == dst->w && s.h == dst->h;
+    int last_sy = -1;
+    for (int y = y0; y < y1; y++) {
+        int sy = s.y + (y - dst->y) * s.h / dst->h;
+        const uint32_t *src_row = (const uint32_t *)((const uint8_t *)sprite->pixels + sy * sprite->pitch);
+        uint32_t *dst_row = &framebuffer[y * screen_width + x0];
+        if (unscaled && alpha == 255) {
+            blend_row(dst_row, &src_row[s.x + x0 - dst->x], n);
+            continue;
+        }
+        if (sy != last_sy) {
+            for (int x = x0; x < x1; x++) {
+                framebuffer_line[x - x0] = src_row[s.x + (x - dst->x) * s.w / dst->w];
+            }
+            if (alpha != 255) {
+                fade_row(framebuffer_line, n, alpha);
+            }
+            last_sy = sy;
+        }
+        blend_row(dst_row, framebuffer_line, n);
+    }
+}
+
+void clear_frame() {
+    if (!cpu_renderer) {
+        SDL_RenderClear(renderer);
+        return;
+    }
+    const uint32_t clear_color = 0xff202040;
+    for (uint32_t i = 0; i < screen_width * screen_height; i++) {
+        framebuffer[i] = clear_color;
+    }
+}
+
+void draw_sprite(int id, const SDL_Rect *src, const SDL_Rect *dst) {
+    draw_sprite_alpha(id, src, dst, 255);
+}
+
+void draw_sprite_alpha(int id, const SDL_Rect *src, const SDL_Rect *dst, uint8_t alpha) {
+    if (cpu_renderer) {
+        blit_sprite(assets[id].sprite, src, dst, alpha);
+        return;
+    }
+    SDL_Texture *texture = *assets[id].texture;
+    if (alpha != 255) {
+        SDL_SetTextureAlphaMod(texture, alpha);
+    }
+    SDL_RenderCopy(renderer, texture, src, dst);
+    if (alpha != 255) {
+        SDL_SetTextureAlphaMod(texture, 255);
+    }
+}
+
+void present_frame() {
+    if (!cpu_renderer) {
+        SDL_RenderPresent(renderer);
+        return;
+    }
+    if (headless) {
+        return;
+    }
+    SDL_Surface *window_surface = SDL_GetWindowSurface(win);
+    if (window_surface == NULL) {
+        return;
+    }
+    // Letterbox like SDL_RenderSetLogicalSize.
+    float scale = fmin((float)window_surface->w / screen_width, (float)window_surface->h / screen_height);
+    SDL_Rect dst_rect = {.w = screen_width * scale, .h = screen_height * scale};
+    dst_rect.x = (window_surface->w - dst_rect.w) / 2;
+    dst_rect.y = (window_surface->h - dst_rect.h) / 2;
+    if (dst_rect.w != window_surface->w || dst_rect.h != window_surface->h) {
+        SDL_FillRect(window_surface, NULL, 0);
+    }
+    SDL_BlitScaled(framebuffer_surface, NULL, window_surface, &dst_rect);
+    SDL_UpdateWindowSurface(win);
+}
+
+// Copy the bricks of level that are at least partly on screen at view_y
+// into out, which holds MAX_NUM_BRICKS. Returns how many were copied.
+int cull_bricks(brick_t *out, const brick_t *level, int n, float view_y) {
+    int num_visible = 0;
+    for (int i = 0; i < n && num_visible < MAX_NUM_BRICKS; i++) {
+        const brick_t *brick = &level[i];
+        if (brick->x == 0 && brick->y == 0) {
+            continue;
+        }
+        if (brick->y + brick_height > view_y && brick->y < view_y + screen_height) {
+            out[num_visible++] = *brick;
+        }
+    }
+    return num_visible;
+}
+
+// Fill the slot the simulation owns from the current state, then swap it with
+// the newest slot. Never blocks: a snapshot the renderer has not taken yet is
+// simply replaced.
+void publish_render_snapshot() {
+    PROFILE_ZONE("publish");
+    render_snapshot_t *r = &render_snapshots[render_snapshot_write];
+    r->ball = ball;
+    r->player = player;
+    r->ball_sprite = player_carrying_ball || ball_bouncing ? ASSET_BALL_SQUASH : ASSET_BALL;
+    r->player_sprite = ASSET_PLAYER;
+    if (!player_on_ground && air_time >= coyote_time) {
+        r->player_sprite = player_jumping ? ASSET_PLAYER_JUMP : ASSET_PLAYER_FALL;
+    }
+    r->num_bricks = cull_bricks(r->bricks, bricks, MAX_NUM_BRICKS, camera_y);
+    r->camera_y = camera_y;
+    r->score = score;
+    r->high_score = high_score;
+    r->show_remote = false;
+    r->show_game_over = game_over && (!versus || remote_state.game_over);
+#ifdef NETPLAY
+    if (versus && net_connected) {
+        r->show_remote = true;
+        r->remote_ball = remote_state.ball;
+        r->remote_player = remote_state.player;
+        r->remote_ball_sprite = remote_state.player_carrying_ball || remote_state.ball_bouncing ? ASSET_BALL_SQUASH : ASSET_BALL;
+        r->remote_player_sprite = ASSET_PLAYER;
+        if (!remote_state.player_on_ground && remote_state.air_time >= coyote_time) {
+            r->remote_player_sprite = remote_state.player_jumping ? ASSET_PLAYER_JUMP : ASSET_PLAYER_FALL;
+        }
+        r->remote_score = remote_state.score;
+    }
+#endif
+    SDL_AtomicSet(&render_snapshot_time, SDL_GetTicks());
+    int previous = SDL_AtomicSet(&render_snapshot_latest, render_snapshot_write | RENDER_SNAPSHOT_FRESH);
+    render_snapshot_write = previous & ~RENDER_SNAPSHOT_FRESH;
+}
+
+// The newest snapshot published since the last call, or NULL if there is none.
+// It stays valid until the next call.
+const render_snapshot_t *take_render_snapshot() {
+    if (!(SDL_AtomicGet(&render_snapshot_latest) & RENDER_SNAPSHOT_FRESH)) {
+        return NULL;
+    }
+    int previous = SDL_AtomicSet(&render_snapshot_latest, render_snapshot_read);
+    render_snapshot_read = previous & ~RENDER_SNAPSHOT_FRESH;
+    return &render_snapshots[render_snapshot_read];
+}
+
+// Milliseconds until the simulation is due to publish again: 0 if a snapshot
+// is already waiting, and 1 once it is overdue so a late one is not spun on.
+uint32_t time_to_next_snapshot() {
+    if (SDL_AtomicGet(&render_snapshot_latest) & RENDER_SNAPSHOT_FRESH) {
+        return 0;
+    }
+    uint32_t interval = (uint32_t)ceilf(seconds_per_frame * 1000.0f);
+    uint32_t elapsed = SDL_GetTicks() - (uint32_t)SDL_AtomicGet(&render_snapshot_time);
+    return elapsed < interval ? interval - elapsed : 1;
+}
+
+void draw_ball(const body_t *b, int sprite, float view_y, uint8_t alpha) {
+    SDL_Rect dst_rect = {.x = (int)(b->px - ball_radius), .y = screen_height - (int)(b->py + ball_radius - view_y), .w = (int)(ball_radius * 2), .h = (int)(ball_radius * 2)};
+    if (sprite == ASSET_BALL_SQUASH) {
+        const int ball_squash_width = 2.0f * ball_radius + 4.0f * 4.0f;
+        float x = b->px - (float)ball_squash_width / 2.0f;
+        dst_rect.w = ball_squash_width;
+        dst_rect.x = x;
+    }
+    dst_rect.x = positive_fmod(dst_rect.x, screen_width);
+    SDL_Rect wrap_rect = dst_rect;
+    wrap_rect.x -= screen_width;
+    draw_sprite_alpha(sprite, NULL, &dst_rect, alpha);
+    draw_sprite_alpha(sprite, NULL, &wrap_rect, alpha);
+}
+
+void draw_player(const body_t *p, int sprite, float view_y, uint8_t alpha) {
+    SDL_Rect dst_rect = {.x = (int)p->px, .y = screen_height - (int)(p->py + player_height - view_y), .w = (int)player_width, .h = (int)player_height};
+    dst_rect.x = positive_fmod(dst_rect.x, screen_width);
+    SDL_Rect wrap_rect = dst_rect;
+    wrap_rect.x -= screen_width;
+    draw_sprite_alpha(sprite, NULL, &dst_rect, alpha);
+    draw_sprite_alpha(sprite, NULL, &wrap_rect, alpha);
+}
+
+// Submit draw calls for a snapshot. Presenting is left to the caller.
+void render(const render_snapshot_t *r) {
+    PROFILE_BEGIN("render bricks");
+    clear_frame();
+    for (int i = 0; i < r->num_bricks; i++) {
+        const brick_t *brick = &r->bricks[i];
+        SDL_Rect dst_rect = {.x = (int)brick->x, .y = screen_height - (int)(brick->y + brick_height - r->camera_y), .w = (int)brick_width, .h = (int)brick_height};
         dst_rect.x = positive_fmod(dst_rect.x, screen_width);
         SDL_Rect wrap_rect = dst_rect;
         wrap_rect.x -= screen_width;
-        if (player_on_ground || air_time < coyote_time) {
-            SDL_RenderCopy(renderer, player_texture, NULL, &dst_rect);
-            SDL_RenderCopy(renderer, player_texture, NULL, &wrap_rect);
-        } else {
-            if (player_jumping) {
-                SDL_RenderCopy(renderer, player_jump_texture, NULL, &dst_rect);
-                SDL_RenderCopy(renderer, player_jump_texture, NULL, &wrap_rect);
-            } else {
-                SDL_RenderCopy(renderer, player_fall_texture, NULL, &dst_rect);
-                SDL_RenderCopy(renderer, player_fall_texture, NULL, &wrap_rect);
-            }
+        draw_sprite(ASSET_BRICK, NULL, &dst_rect);
+        draw_sprite(ASSET_BRICK, NULL, &wrap_rect);
+    }
+    PROFILE_END();
+    {
+        PROFILE_ZONE("render ball");
+        draw_ball(&r->ball, r->ball_sprite, r->camera_y, 255);
+    }
+    {
+        PROFILE_ZONE("render player");
+        draw_player(&r->player, r->player_sprite, r->camera_y, 255);
+    }
+    if (r->show_remote) {
+        PROFILE_ZONE("render ghost");
+        // Draw the remote player and ball as a translucent ghost.
+        draw_ball(&r->remote_ball, r->remote_ball_sprite, r->camera_y, 96);
+        draw_player(&r->remote_player, r->remote_player_sprite, r->camera_y, 96);
+
+        // Remote score in the bottom left corner.
+        int num_digits = 1;
+        for (uint32_t n = r->remote_score; n >= 10; n /= 10) {
+            num_digits++;
+        }
+        int digit = r->remote_score;
+        for (int i = 0; i < num_digits; i++) {
+            SDL_Rect src_rect = {(digit % 10) * glyph_width, 0, glyph_width, glyph_height};
+            SDL_Rect dst_rect = {glyph_width * (num_digits - i - 1), screen_height - 2.0f * glyph_height, glyph_width, glyph_height};
+            draw_sprite(ASSET_WHITE_NUMBERS, &src_rect, &dst_rect);
+            digit /= 10;
         }
     }
     {
-        int digit = score;
+        PROFILE_ZONE("render score");
+        int digit = r->score;
         int i = 0;
         do {
             SDL_Rect src_rect = {(digit % 10) * glyph_width, 0, glyph_width, glyph_height};
             SDL_Rect dst_rect = {screen_width - glyph_width * (i + 1), screen_height - 2.0f * glyph_height, glyph_width, glyph_height};
-            SDL_RenderCopy(renderer, white_numbers_texture, &src_rect, &dst_rect);
+            draw_sprite(ASSET_WHITE_NUMBERS, &src_rect, &dst_rect);
             digit /= 10;
             i++;
         } while (digit > 0);
     }
     {
-        int digit = high_score;
+        PROFILE_ZONE("render high score");
+        int digit = r->high_score;
         int i = 0;
         do {
             SDL_Rect src_rect = {(digit % 10) * glyph_width, 0, glyph_width, glyph_height};
             SDL_Rect dst_rect = {screen_width - glyph_width * (i + 1), screen_height - glyph_height, glyph_width, glyph_height};
-            SDL_RenderCopy(renderer, yellow_numbers_texture, &src_rect, &dst_rect);
+            draw_sprite(ASSET_YELLOW_NUMBERS, &src_rect, &dst_rect);
             digit /= 10;
             i++;
         } while (digit > 0);
     }
     if (show_fps) {
+        PROFILE_ZONE("render fps");
         int digit = fps;
         int i = 0;
         do {
             SDL_Rect src_rect = {(digit % 10) * glyph_width, 0, glyph_width, glyph_height};
             SDL_Rect dst_rect = {screen_width - glyph_width * (i + 1), 0, glyph_width, glyph_height};
-            SDL_RenderCopy(renderer, white_numbers_texture, &src_rect, &dst_rect);
+            draw_sprite(ASSET_WHITE_NUMBERS, &src_rect, &dst_rect);
             digit /= 10;
             i++;
         } while (digit > 0);
         SDL_Rect dst_rect = {screen_width - glyph_width * i - fps_text_width, 0, fps_text_width, fps_text_height};
-        SDL_RenderCopy(renderer, fps_text_texture, NULL, &dst_rect);
+        draw_sprite(ASSET_FPS_TEXT, NULL, &dst_rect);
     }
-    if (game_over) {
+    if (r->show_game_over) {
+        PROFILE_ZONE("render game over");
         SDL_Rect dst_rect = {screen_width * 0.5f - game_over_text_width * 0.5f, screen_height * 0.5f - game_over_text_height * 0.5f, game_over_text_width, game_over_text_height};
-        SDL_RenderCopy(renderer, game_over_text_texture, NULL, &dst_rect);
+        draw_sprite(ASSET_GAME_OVER_TEXT, NULL, &dst_rect);
     }
-    SDL_RenderPresent(renderer);
 }
 
-#ifdef WIN32
-int WinMain() {
-#else
-int main() {
+// Advance the simulation by one fixed step and publish the result. Runs on
+// the simulation thread where there is one, otherwise from one_iter().
+void sim_tick(uint8_t input) {
+    // Cleared only after publishing; is_idle() relies on seeing one or the other.
+    if (SDL_AtomicGet(&sim_reset_requested)) {
+        init();
+        publish_render_snapshot();
+        SDL_AtomicSet(&sim_reset_requested, 0);
+        return;
+    }
+#ifdef NETPLAY
+    if (versus) {
+        net_update(input);
+        publish_render_snapshot();
+        return;
+    }
 #endif
-    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO)) {
-        return EXIT_FAILURE;
+    // Nothing changes until a restart, so the last snapshot stays on screen.
+    if (game_over) {
+        return;
     }
+    step(input);
+    if (score > high_score) {
+        high_score = score;
+    }
+#ifdef TELEMETRY
+    telemetry_record_tick();
+#endif
+    publish_render_snapshot();
+}
 
-    if (Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, 2048)) {
-        return EXIT_FAILURE;
+void wake_sim() {
+#ifdef SIM_THREAD
+    SDL_SemPost(sim_wake);
+#endif
+}
+
+#ifdef SIM_THREAD
+// Call sim_tick() every seconds_per_frame, however long the main thread
+// spends rendering and presenting. After a long stall, such as a debugger
+// break, it resumes from now rather than replaying every missed step. While
+// paused or on the game over screen it sleeps until wake_sim().
+int sim_thread_main(void *data) {
+    (void)data;
+    PROFILE_THREAD("sim");
+    uint64_t frequency = SDL_GetPerformanceFrequency();
+    uint64_t ticks_per_step = frequency * seconds_per_frame;
+    uint64_t next_step = SDL_GetPerformanceCounter();
+    while (!SDL_AtomicGet(&sim_stop)) {
+        bool waiting_for_restart = !versus && game_over && !SDL_AtomicGet(&sim_reset_requested);
+        if (SDL_AtomicGet(&sim_paused) || waiting_for_restart) {
+            SDL_SemWait(sim_wake);
+            next_step = SDL_GetPerformanceCounter();
+            continue;
+        }
+        uint64_t now = SDL_GetPerformanceCounter();
+        if (now < next_step) {
+            uint32_t ms = (next_step - now) * 1000 / frequency;
+            SDL_Delay(ms > 0 ? ms : 1);
+            continue;
+        }
+        sim_tick(SDL_AtomicGet(&sim_input));
+        next_step += ticks_per_step;
+        if (now > next_step + SIM_MAX_CATCHUP_STEPS * ticks_per_step) {
+            next_step = now;
+        }
     }
+    return 0;
+}
+#endif
 
-    Mix_Volume(-1, MIX_MAX_VOLUME / 4);
+void handle_window_event(const SDL_WindowEvent *e) {
+    switch (e->event) {
+    case SDL_WINDOWEVENT_FOCUS_GAINED:
+        window_focused = true;
+        break;
+    case SDL_WINDOWEVENT_FOCUS_LOST:
+        window_focused = false;
+        break;
+    case SDL_WINDOWEVENT_MINIMIZED:
+        window_minimized = true;
+        break;
+    case SDL_WINDOWEVENT_RESTORED:
+        window_minimized = false;
+        redraw_needed = true;
+        break;
+    case SDL_WINDOWEVENT_EXPOSED:
+    case SDL_WINDOWEVENT_SIZE_CHANGED:
+        redraw_needed = true;
+        break;
+    }
+    update_paused();
+}
 
-    win = SDL_CreateWindow(window_title, SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, screen_width, screen_height, 0);
+// Pause or resume to match the window state. Versus mode keeps simulating in
+// the background, since the peer cannot wait.
+void update_paused() {
+    bool background = !window_focused || window_minimized || page_hidden;
+    if (background == paused) {
+        return;
+    }
+    paused = background;
+    if (paused) {
+        Mix_Pause(-1);
+    } else {
+        Mix_Resume(-1);
+    }
+    SDL_AtomicSet(&sim_paused, paused && !versus);
+    wake_sim();
+}
 
-    if (win == NULL) {
-        return EXIT_FAILURE;
+// Whether the main loop can sleep until the next event: nothing new will be
+// published and the current frame needs no redraw.
+bool is_idle() {
+    if (window_minimized || page_hidden) {
+        return true;
     }
+    if (versus || redraw_needed) {
+        return false;
+    }
+    if (!window_focused) {
+        return true;
+    }
+    if (shown_snapshot == NULL || !shown_snapshot->show_game_over || SDL_AtomicGet(&sim_reset_requested)) {
+        return false;
+    }
+    return !(SDL_AtomicGet(&render_snapshot_latest) & RENDER_SNAPSHOT_FRESH);
+}
 
-    renderer = SDL_CreateRenderer(win, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
-    if (renderer == NULL) {
-        return EXIT_FAILURE;
+#ifdef __EMSCRIPTEN__
+// Stop the main loop entirely while the tab is hidden.
+EM_BOOL on_visibility_change(int event_type, const EmscriptenVisibilityChangeEvent *e, void *data) {
+    (void)event_type;
+    (void)data;
+    page_hidden = e->hidden;
+    update_paused();
+    if (page_hidden) {
+        emscripten_pause_main_loop();
+    } else {
+        redraw_needed = true;
+        emscripten_resume_main_loop();
     }
+    return EM_TRUE;
+}
+#endif
 
-    SDL_SetRenderDrawColor(renderer, 32, 32, 64, 255);
+void one_iter() {
+    PROFILE_ZONE("frame");
+    PROFILE_BEGIN("input");
+    SDL_Event e;
+    if (SDL_PollEvent(&e)) {
+        if (e.type == SDL_QUIT) {
+            should_quit = true;
+            PROFILE_END();
+            return;
+        } else if (e.type == SDL_WINDOWEVENT) {
+            handle_window_event(&e.window);
+        }
+    }
 
-    SDL_RenderSetLogicalSize(renderer, screen_width, screen_height);
+    const Uint8 *keystates = SDL_GetKeyboardState(NULL);
+    uint8_t input = 0;
+    if (keystates[SDL_SCANCODE_A] || keystates[SDL_SCANCODE_LEFT]) {
+        input |= INPUT_LEFT;
+    }
+    if (keystates[SDL_SCANCODE_D] || keystates[SDL_SCANCODE_RIGHT]) {
+        input |= INPUT_RIGHT;
+    }
+    if (keystates[SDL_SCANCODE_S] || keystates[SDL_SCANCODE_DOWN]) {
+        input |= INPUT_DOWN;
+    }
+    if (keystates[SDL_SCANCODE_SPACE] || keystates[SDL_SCANCODE_W]) {
+        input |= INPUT_JUMP;
+    }
+    // In versus mode R is sent to the peer as an input, and both clients
+    // restart at an agreed step.
+    if (versus && keystates[SDL_SCANCODE_R]) {
+        input |= INPUT_RESTART;
+    }
+    SDL_AtomicSet(&sim_input, input);
 
-    loading_surf = IMG_Load("assets/ball3.png");
-    printf("%s\n", IMG_GetError());
-    assert(loading_surf != NULL);
-    ball_texture = SDL_CreateTextureFromSurface(renderer, loading_surf);
-    assert(ball_texture != NULL);
-    loading_surf = IMG_Load("assets/ball_squash.png");
-    ball_squash_texture = SDL_CreateTextureFromSurface(renderer, loading_surf);
+    // Both clients simulate from the same seed, so restarting one would desync.
+    if (!versus && !reset_pressed && keystates[SDL_SCANCODE_R]) {
+        reset_pressed = keystates[SDL_SCANCODE_R];
+        SDL_AtomicSet(&sim_reset_requested, 1);
+        wake_sim();
+    } else if (reset_pressed && !keystates[SDL_SCANCODE_R]) {
+        reset_pressed = keystates[SDL_SCANCODE_R];
+    }
 
-    loading_surf = IMG_Load("assets/guy2.png");
-    player_texture = SDL_CreateTextureFromSurface(renderer, loading_surf);
-    loading_surf = IMG_Load("assets/guy2_jump.png");
-    player_jump_texture = SDL_CreateTextureFromSurface(renderer, loading_surf);
-    loading_surf = IMG_Load("assets/guy2_fall.png");
-    player_fall_texture = SDL_CreateTextureFromSurface(renderer, loading_surf);
+    bool show_fps_keystates = keystates[SDL_SCANCODE_P];
+    if (!show_fps_pressed && show_fps_keystates) {
+        show_fps_pressed = true;
+        show_fps = !show_fps;
+    } else if (show_fps_pressed && !show_fps_keystates) {
+        show_fps_pressed = false;
+    }
 
-    loading_surf = IMG_Load("assets/brick2.png");
-    brick_texture = SDL_CreateTextureFromSurface(renderer, loading_surf);
-    assert(brick_texture != NULL);
+    bool toggle_fullscreen_keystates = keystates[SDL_SCANCODE_F];
+    if (!toggle_fullscreen_pressed && toggle_fullscreen_keystates) {
+        toggle_fullscreen_pressed = true;
+        fullscreen = !fullscreen;
+        if (fullscreen) {
+            SDL_SetWindowFullscreen(win, SDL_WINDOW_FULLSCREEN_DESKTOP);
+        } else {
+            SDL_SetWindowFullscreen(win, 0);
+        }
+    } else if (toggle_fullscreen_pressed && !toggle_fullscreen_keystates) {
+        toggle_fullscreen_pressed = false;
+    }
 
-    loading_surf = IMG_Load("assets/white_numbers.png");
-    white_numbers_texture = SDL_CreateTextureFromSurface(renderer, loading_surf);
-    loading_surf = IMG_Load("assets/yellow_numbers.png");
-    yellow_numbers_texture = SDL_CreateTextureFromSurface(renderer, loading_surf);
+#ifdef HOT_RELOAD
+    reload_changed_assets();
+#endif
 
-    glyph_width = loading_surf->w / 10;
-    glyph_height = loading_surf->h;
+#ifdef PROFILE
+    bool dump_trace_keystates = keystates[SDL_SCANCODE_T];
+    if (!dump_trace_pressed && dump_trace_keystates) {
+        dump_trace_pressed = true;
+        profile_dump(trace_path);
+    } else if (dump_trace_pressed && !dump_trace_keystates) {
+        dump_trace_pressed = false;
+    }
+#endif
+    PROFILE_END();
+
+#ifndef SIM_THREAD
+    if (!SDL_AtomicGet(&sim_paused)) {
+        sim_tick(input);
+    }
+#endif
+    if (paused) {
+        SDL_AtomicSet(&queued_sfx, 0);
+    } else {
+        play_queued_sfx();
+    }
+
+    if (window_minimized) {
+        return;
+    }
+    const render_snapshot_t *snapshot = take_render_snapshot();
+    if (snapshot == NULL) {
+        if (redraw_needed && shown_snapshot != NULL) {
+            redraw_needed = false;
+            render(shown_snapshot);
+            present_frame();
+        }
+        return;
+    }
+    shown_snapshot = snapshot;
+    redraw_needed = false;
+
+    frames++;
+    uint32_t ticks = SDL_GetTicks();
+    uint32_t delta = ticks - last_fps_update_time;
+    if (delta > 200) {
+        fps = (float)frames / (float)delta * 1000.0f;
+        last_fps_update_time = ticks;
+        frames = 0;
+    }
+
+    render(snapshot);
+    PROFILE_BEGIN("present");
+    present_frame();
+    PROFILE_END();
+}
+
+// Load the file behind asset, replacing what was loaded before only if that
+// succeeds. Decoded pixels are freed as soon as they are uploaded.
+bool load_asset(asset_t *asset) {
+    if (asset->texture != NULL && cpu_renderer) {
+        SDL_Surface *surface = IMG_Load(asset->path);
+        if (surface == NULL) {
+            fprintf(stderr, "%s: %s\n", asset->path, IMG_GetError());
+            return false;
+        }
+        SDL_Surface *sprite = SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_ARGB8888, 0);
+        SDL_FreeSurface(surface);
+        if (sprite == NULL) {
+            fprintf(stderr, "%s: %s\n", asset->path, SDL_GetError());
+            return false;
+        }
+        for (int y = 0; y < sprite->h; y++) {
+            uint32_t *row = (uint32_t *)((uint8_t *)sprite->pixels + y * sprite->pitch);
+            for (int x = 0; x < sprite->w; x++) {
+                uint32_t p = row[x];
+                uint32_t a = p >> 24;
+                uint32_t r = ((p >> 16) & 0xff) * a / 255;
+                uint32_t g = ((p >> 8) & 0xff) * a / 255;
+                uint32_t b = (p & 0xff) * a / 255;
+                row[x] = a << 24 | r << 16 | g << 8 | b;
+            }
+        }
+        if (asset->sprite != NULL) {
+            SDL_FreeSurface(asset->sprite);
+        }
+        asset->sprite = sprite;
+        asset->w = sprite->w;
+        asset->h = sprite->h;
+        asset->cpu_bytes = (size_t)sprite->pitch * sprite->h;
+        asset->gpu_bytes = 0;
+    } else if (asset->texture != NULL) {
+        SDL_Surface *surface = IMG_Load(asset->path);
+        if (surface == NULL) {
+            fprintf(stderr, "%s: %s\n", asset->path, IMG_GetError());
+            return false;
+        }
+        SDL_Texture *texture = SDL_CreateTextureFromSurface(renderer, surface);
+        int w = surface->w;
+        int h = surface->h;
+        SDL_FreeSurface(surface);
+        if (texture == NULL) {
+            fprintf(stderr, "%s: %s\n", asset->path, SDL_GetError());
+            return false;
+        }
+        Uint32 format;
+        SDL_QueryTexture(texture, &format, NULL, NULL, NULL);
+        if (*asset->texture != NULL) {
+            SDL_DestroyTexture(*asset->texture);
+        }
+        *asset->texture = texture;
+        asset->w = w;
+        asset->h = h;
+        asset->cpu_bytes = 0;
+        asset->gpu_bytes = (size_t)w * h * SDL_BYTESPERPIXEL(format);
+    } else {
+        Mix_Chunk *chunk = Mix_LoadWAV(asset->path);
+        if (chunk == NULL) {
+            fprintf(stderr, "%s: %s\n", asset->path, Mix_GetError());
+            return false;
+        }
+        if (*asset->chunk != NULL) {
+            // Also halts any channel still playing it.
+            Mix_FreeChunk(*asset->chunk);
+        }
+        *asset->chunk = chunk;
+        asset->cpu_bytes = chunk->alen;
+        asset->gpu_bytes = 0;
+    }
+    return true;
+}
 
-    loading_surf = IMG_Load("assets/game_over_text.png");
-    game_over_text_texture = SDL_CreateTextureFromSurface(renderer, loading_surf);
+// Sizes the renderer needs from image assets.
+void update_asset_sizes() {
+    glyph_width = assets[ASSET_YELLOW_NUMBERS].w / 10;
+    glyph_height = assets[ASSET_YELLOW_NUMBERS].h;
+    game_over_text_width = assets[ASSET_GAME_OVER_TEXT].w;
+    game_over_text_height = assets[ASSET_GAME_OVER_TEXT].h;
+    fps_text_width = assets[ASSET_FPS_TEXT].w;
+    fps_text_height = assets[ASSET_FPS_TEXT].h;
+}
 
-    game_over_text_width = loading_surf->w;
-    game_over_text_height = loading_surf->h;
+bool load_assets() {
+    for (int i = 0; i < NUM_ASSETS; i++) {
+        if (!load_asset(&assets[i])) {
+            return false;
+        }
+    }
+    update_asset_sizes();
+    return true;
+}
 
-    loading_surf = IMG_Load("assets/fps_text.png");
-    fps_text_texture = SDL_CreateTextureFromSurface(renderer, loading_surf);
+void print_asset_memory() {
+    size_t cpu_total = 0;
+    size_t gpu_total = 0;
+    for (int i = 0; i < NUM_ASSETS; i++) {
+        printf("%-28s %8zu B cpu %8zu B gpu\n", assets[i].path, assets[i].cpu_bytes, assets[i].gpu_bytes);
+        cpu_total += assets[i].cpu_bytes;
+        gpu_total += assets[i].gpu_bytes;
+    }
+    printf("%-28s %8zu B cpu %8zu B gpu\n", "total", cpu_total, gpu_total);
+}
 
-    fps_text_width = loading_surf->w;
-    fps_text_height = loading_surf->h;
+void free_assets() {
+#ifdef HOT_RELOAD
+    if (assets_inotify >= 0) {
+        close(assets_inotify);
+        assets_inotify = -1;
+    }
+#endif
+    for (int i = 0; i < NUM_ASSETS; i++) {
+        if (assets[i].texture != NULL && *assets[i].texture != NULL) {
+            SDL_DestroyTexture(*assets[i].texture);
+            *assets[i].texture = NULL;
+        }
+        if (assets[i].chunk != NULL && *assets[i].chunk != NULL) {
+            Mix_FreeChunk(*assets[i].chunk);
+            *assets[i].chunk = NULL;
+        }
+        if (assets[i].sprite != NULL) {
+            SDL_FreeSurface(assets[i].sprite);
+            assets[i].sprite = NULL;
+        }
+        assets[i].cpu_bytes = 0;
+        assets[i].gpu_bytes = 0;
+    }
+}
 
-    sfx_jump = Mix_LoadWAV("assets/jump.wav");
-    assert(sfx_jump != NULL);
-    sfx_game_over = Mix_LoadWAV("assets/game_over.wav");
-    assert(sfx_game_over != NULL);
-    sfx_bounce_start = Mix_LoadWAV("assets/bounce_start.wav");
-    assert(sfx_bounce_start != NULL);
-    sfx_bounce_end = Mix_LoadWAV("assets/bounce_end.wav");
-    assert(sfx_bounce_end != NULL);
-    sfx_brick_break = Mix_LoadWAV("assets/kick3.wav");
-    assert(sfx_brick_break != NULL);
+#ifdef HOT_RELOAD
+// Watch the assets directory rather than each file, since editors usually save
+// by writing a new file and renaming it over the old one.
+void watch_assets() {
+    assets_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (assets_inotify < 0) {
+        perror("inotify_init1");
+        return;
+    }
+    if (inotify_add_watch(assets_inotify, assets_dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        perror(assets_dir);
+        close(assets_inotify);
+        assets_inotify = -1;
+    }
+}
+
+void reload_changed_assets() {
+    if (assets_inotify < 0) {
+        return;
+    }
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool reloaded = false;
+    for (;;) {
+        ssize_t len = read(assets_inotify, buf, sizeof(buf));
+        if (len <= 0) {
+            break;
+        }
+        for (char *p = buf; p < buf + len;) {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + event->len;
+            if (event->len == 0) {
+                continue;
+            }
+            for (int i = 0; i < NUM_ASSETS; i++) {
+                const char *name = assets[i].path + strlen(assets_dir) + 1;
+                if (strcmp(name, event->name) == 0 && load_asset(&assets[i])) {
+                    printf("reloaded %s\n", assets[i].path);
+                    reloaded = true;
+                }
+            }
+        }
+    }
+    if (reloaded) {
+        update_asset_sizes();
+        print_asset_memory();
+        redraw_needed = true;
+    }
+}
+#endif
+
+#ifdef TELEMETRY
+int put_varint(uint8_t *p, uint32_t v) {
+    int n = 0;
+    while (v >= 0x80) {
+        p[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    p[n++] = v;
+    return n;
+}
+
+int telemetry_flush_thread(void *data) {
+    (void)data;
+    for (;;) {
+        bool stopping = SDL_AtomicGet(&telemetry_stop);
+        uint32_t head = SDL_AtomicGet(&telemetry_head);
+        SDL_MemoryBarrierAcquire();
+        uint32_t tail = SDL_AtomicGet(&telemetry_tail);
+        if (head != tail) {
+            uint32_t start = tail & (TELEMETRY_RING_SIZE - 1);
+            uint32_t len = head - tail;
+            uint32_t first = len < TELEMETRY_RING_SIZE - start ? len : TELEMETRY_RING_SIZE - start;
+            fwrite(&telemetry_ring[start], 1, first, telemetry_file);
+            fwrite(telemetry_ring, 1, len - first, telemetry_file);
+            fflush(telemetry_file);
+            SDL_AtomicSet(&telemetry_tail, head);
+        }
+        if (stopping) {
+            return 0;
+        }
+        SDL_Delay(TELEMETRY_FLUSH_INTERVAL);
+    }
+}
+
+// Start a telemetry session, appended to path. The file is a sequence of
+// sessions, each a 12 byte header (magic, version, TELEMETRY_SCALE) followed
+// by one record per local step:
+//
+//   u8      EVENT_* flags
+//   varint  seed, if EVENT_LEVEL_START
+//   varint  tick, if EVENT_SYNC; the fields below are then absolute
+//   u16     mask of the fields that changed since the previous record
+//   varint  zigzag delta of each changed field, lowest bit first
+//
+// Fields are ball px, py, vx, vy, player px, py, vx, vy, camera_y in units of
+// 1 / TELEMETRY_SCALE pixels (or pixels/s), then score. Ticks without
+// EVENT_SYNC follow the previous record's tick by one.
+bool telemetry_open(const char *path) {
+    telemetry_file = fopen(path, "ab");
+    if (telemetry_file == NULL) {
+        perror(path);
+        return false;
+    }
+    uint8_t header[12];
+    put_u32(&header[0], TELEMETRY_MAGIC);
+    put_u32(&header[4], TELEMETRY_VERSION);
+    put_u32(&header[8], (uint32_t)TELEMETRY_SCALE);
+    fwrite(header, 1, sizeof(header), telemetry_file);
+    telemetry_need_sync = true;
+    telemetry_thread = SDL_CreateThread(telemetry_flush_thread, "telemetry", NULL);
+    if (telemetry_thread == NULL) {
+        fprintf(stderr, "telemetry: %s\n", SDL_GetError());
+        fclose(telemetry_file);
+        telemetry_file = NULL;
+        return false;
+    }
+    return true;
+}
+
+// Mark the local player's next record as the first of a level. Not called
+// for the remote simulation in versus mode, which also starts levels.
+void telemetry_start_level(uint32_t seed) {
+    telemetry_seed = seed;
+    telemetry_level_started = true;
+}
+
+// Append a record for the step that just ran. Never blocks: if the flush
+// thread has fallen behind the record is dropped, and the next one that fits
+// is written with EVENT_SYNC so the stream can be decoded past the gap.
+void telemetry_record_tick() {
+    if (telemetry_file == NULL) {
+        return;
+    }
+    uint8_t events = tick_events;
+    if (telemetry_level_started) {
+        events |= EVENT_LEVEL_START;
+        telemetry_level_started = false;
+        telemetry_need_sync = true;
+        telemetry_tick = 0;
+    }
+    if (telemetry_need_sync) {
+        events |= EVENT_SYNC;
+        memset(telemetry_last, 0, sizeof(telemetry_last));
+    }
+
+    int32_t fields[TELEMETRY_NUM_FIELDS] = {
+        lrintf(ball.px * TELEMETRY_SCALE),
+        lrintf(ball.py * TELEMETRY_SCALE),
+        lrintf(ball.vx * TELEMETRY_SCALE),
+        lrintf(ball.vy * TELEMETRY_SCALE),
+        lrintf(player.px * TELEMETRY_SCALE),
+        lrintf(player.py * TELEMETRY_SCALE),
+        lrintf(player.vx * TELEMETRY_SCALE),
+        lrintf(player.vy * TELEMETRY_SCALE),
+        lrintf(camera_y * TELEMETRY_SCALE),
+        score,
+    };
+    uint8_t record[TELEMETRY_MAX_RECORD_SIZE];
+    int len = 0;
+    record[len++] = events;
+    if (events & EVENT_LEVEL_START) {
+        len += put_varint(&record[len], telemetry_seed);
+    }
+    if (events & EVENT_SYNC) {
+        len += put_varint(&record[len], telemetry_tick);
+    }
+    int mask_offset = len;
+    len += 2;
+    uint16_t mask = 0;
+    for (int i = 0; i < TELEMETRY_NUM_FIELDS; i++) {
+        int32_t delta = fields[i] - telemetry_last[i];
+        if (delta != 0) {
+            mask |= 1 << i;
+            len += put_varint(&record[len], ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31));
+        }
+    }
+    record[mask_offset] = mask;
+    record[mask_offset + 1] = mask >> 8;
+    telemetry_tick++;
+
+    uint32_t head = SDL_AtomicGet(&telemetry_head);
+    uint32_t tail = SDL_AtomicGet(&telemetry_tail);
+    if (TELEMETRY_RING_SIZE - (head - tail) < (uint32_t)len) {
+        telemetry_dropped++;
+        telemetry_need_sync = true;
+        return;
+    }
+    for (int i = 0; i < len; i++) {
+        telemetry_ring[(head + i) & (TELEMETRY_RING_SIZE - 1)] = record[i];
+    }
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicSet(&telemetry_head, head + len);
+    memcpy(telemetry_last, fields, sizeof(telemetry_last));
+    telemetry_need_sync = false;
+}
+
+void telemetry_close() {
+    if (telemetry_file == NULL) {
+        return;
+    }
+    SDL_AtomicSet(&telemetry_stop, 1);
+    SDL_WaitThread(telemetry_thread, NULL);
+    fclose(telemetry_file);
+    telemetry_file = NULL;
+    if (telemetry_dropped > 0) {
+        printf("telemetry: dropped %u records\n", telemetry_dropped);
+    }
+}
+#endif
+
+int compare_float(const void *a, const void *b) {
+    float x = *(const float *)a;
+    float y = *(const float *)b;
+    return (x > y) - (x < y);
+}
+
+// Sorts samples in place.
+void print_frame_stats(const char *label, float *samples, uint32_t n) {
+    double sum = 0.0;
+    for (uint32_t i = 0; i < n; i++) {
+        sum += samples[i];
+    }
+    qsort(samples, n, sizeof(float), compare_float);
+    printf("%-8s mean %7.3f  min %7.3f  p50 %7.3f  p95 %7.3f  p99 %7.3f  max %7.3f ms\n",
+           label, sum / n, samples[0], samples[n / 2], samples[n * 95 / 100], samples[n * 99 / 100], samples[n - 1]);
+}
+
+// Render a fixed dense level along a scripted camera path and report how long
+// submitting draw calls and presenting took per frame. Every input is
+// deterministic, so runs are comparable across builds and machines.
+void run_render_benchmark(uint32_t num_frames) {
+    brick_t *level = malloc(BENCH_NUM_BRICKS * sizeof(brick_t));
+    float *submit_ms = malloc(num_frames * sizeof(float));
+    float *present_ms = malloc(num_frames * sizeof(float));
+    if (level == NULL || submit_ms == NULL || present_ms == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return;
+    }
+
+    uint32_t rng = 46;
+    for (int i = 0; i < BENCH_NUM_BRICKS; i++) {
+        level[i].x = rand_range(&rng, 1.0f, screen_width);
+        level[i].y = rand_range(&rng, 1.0f, BENCH_LEVEL_HEIGHT);
+    }
+    // Built directly rather than published, since there is no simulation.
+    render_snapshot_t snapshot = {
+        .ball_sprite = ASSET_BALL,
+        .high_score = 987654,
+        .show_game_over = true,
+        .show_remote = true,
+        .remote_ball_sprite = ASSET_BALL,
+        .remote_player_sprite = ASSET_PLAYER,
+    };
+    show_fps = true;
+    fps = 60;
+
+    double ms_per_tick = 1000.0 / (double)SDL_GetPerformanceFrequency();
+    uint32_t num_bricks_on_screen = 0;
+    for (uint32_t frame = 0; frame < num_frames; frame++) {
+        SDL_Event e;
+        while (SDL_PollEvent(&e)) {
+        }
+
+        // Climb the level once over the run, swinging the player and ball
+        // across the wrap.
+        float t = (float)frame / (float)num_frames;
+        snapshot.camera_y = t * (BENCH_LEVEL_HEIGHT - screen_height) + 64.0f * sinf(t * 40.0f);
+        snapshot.player.px = screen_width * (0.5f + 0.6f * sinf(t * 25.0f));
+        snapshot.player.py = snapshot.camera_y + screen_height * 0.4f;
+        snapshot.ball.px = snapshot.player.px + 96.0f * cosf(t * 60.0f);
+        snapshot.ball.py = snapshot.player.py + 160.0f + 64.0f * sinf(t * 60.0f);
+        if (frame % 64 < 32) {
+            snapshot.player_sprite = ASSET_PLAYER;
+        } else {
+            snapshot.player_sprite = frame % 32 < 16 ? ASSET_PLAYER_JUMP : ASSET_PLAYER_FALL;
+        }
+        snapshot.ball_sprite = frame % 16 < 4 ? ASSET_BALL_SQUASH : ASSET_BALL;
+        snapshot.score = frame;
+        // A versus ghost on the opposite swing, so translucent sprites are
+        // drawn too.
+        snapshot.remote_player.px = screen_width - snapshot.player.px;
+        snapshot.remote_player.py = snapshot.player.py - 48.0f;
+        snapshot.remote_ball.px = screen_width - snapshot.ball.px;
+        snapshot.remote_ball.py = snapshot.ball.py;
+        snapshot.remote_score = frame / 2;
+        snapshot.num_bricks = cull_bricks(snapshot.bricks, level, BENCH_NUM_BRICKS, snapshot.camera_y);
+        num_bricks_on_screen += snapshot.num_bricks;
+
+        uint64_t start = SDL_GetPerformanceCounter();
+        render(&snapshot);
+        uint64_t submitted = SDL_GetPerformanceCounter();
+        present_frame();
+        uint64_t presented = SDL_GetPerformanceCounter();
+
+        submit_ms[frame] = (submitted - start) * ms_per_tick;
+        present_ms[frame] = (presented - submitted) * ms_per_tick;
+    }
+
+    printf("%u frames, %d bricks, %.1f bricks on screen per frame, %s renderer\n",
+           num_frames, BENCH_NUM_BRICKS, (float)num_bricks_on_screen / num_frames,
+           cpu_renderer ? "cpu" : software_renderer ? "software" : "default");
+    print_frame_stats("submit", submit_ms, num_frames);
+    print_frame_stats("present", present_ms, num_frames);
+
+    free(present_ms);
+    free(submit_ms);
+    free(level);
+}
+
+#ifdef WIN32
+int WinMain() {
+#else
+int main(int argc, char *argv[]) {
+    // imhp [--seed <seed> | --daily <seed index>]
+    //      [--validate-seeds <first seed> <number of seeds> <seed index>]
+    //      [--bench-render <frames>] [--software | --cpu-renderer] [--headless] [--capture <ppm>]
+    //      [--telemetry <file>] [--watch-assets]
+    //      [--versus <local port> <peer host:port>] [--net-delay <ms>] [--net-loss <percent>]
+    //      [--net-test <steps>]
+#ifdef NETPLAY
+    uint16_t net_local_port = 0;
+    const char *net_peer_address = NULL;
+#endif
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            fixed_seed = true;
+            level_seed = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--daily") == 0 && i + 1 < argc) {
+            fixed_seed = true;
+            if (!pick_daily_seed(argv[++i], &level_seed)) {
+                return EXIT_FAILURE;
+            }
+            printf("daily seed %u\n", level_seed);
+        } else if (strcmp(argv[i], "--validate-seeds") == 0 && i + 3 < argc) {
+            unsigned long long first_seed = strtoull(argv[i + 1], NULL, 10);
+            unsigned long long num_seeds = strtoull(argv[i + 2], NULL, 10);
+            if (first_seed > UINT32_MAX || num_seeds > UINT32_MAX) {
+                fprintf(stderr, "seeds are 32-bit\n");
+                return EXIT_FAILURE;
+            }
+            return validate_seeds(first_seed, num_seeds, argv[i + 3]);
+        } else if (strcmp(argv[i], "--bench-render") == 0 && i + 1 < argc) {
+            bench_frames = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--software") == 0) {
+            software_renderer = true;
+        } else if (strcmp(argv[i], "--cpu-renderer") == 0) {
+            cpu_renderer = true;
+        } else if (strcmp(argv[i], "--headless") == 0) {
+            headless = true;
+        } else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
+            capture_path = argv[++i];
+#ifdef HOT_RELOAD
+        } else if (strcmp(argv[i], "--watch-assets") == 0) {
+            hot_reload = true;
+#endif
+#ifdef TELEMETRY
+        } else if (strcmp(argv[i], "--telemetry") == 0 && i + 1 < argc) {
+            if (!telemetry_open(argv[++i])) {
+                return EXIT_FAILURE;
+            }
+#endif
+#ifdef NETPLAY
+        } else if (strcmp(argv[i], "--versus") == 0 && i + 2 < argc) {
+            versus = true;
+            net_local_port = atoi(argv[++i]);
+            net_peer_address = argv[++i];
+        } else if (strcmp(argv[i], "--net-delay") == 0 && i + 1 < argc) {
+            net_delay = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--net-loss") == 0 && i + 1 < argc) {
+            net_loss = atof(argv[++i]) / 100.0f;
+        } else if (strcmp(argv[i], "--net-test") == 0 && i + 1 < argc) {
+            net_test_steps = strtoul(argv[++i], NULL, 10);
+#endif
+        } else {
+            fprintf(stderr, "unknown argument %s\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+#ifdef NETPLAY
+    if (versus && !net_open(net_local_port, net_peer_address)) {
+        return EXIT_FAILURE;
+    }
+#endif
+#endif
+#ifdef PROFILE
+    profile_start_ticks = SDL_GetPerformanceCounter();
+    PROFILE_THREAD("main");
+#endif
+
+    if (headless) {
+        cpu_renderer = true;
+        SDL_setenv("SDL_VIDEODRIVER", "dummy", 0);
+        SDL_setenv("SDL_AUDIODRIVER", "dummy", 0);
+    }
+
+    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO)) {
+        return EXIT_FAILURE;
+    }
+
+    if (Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, 2048)) {
+        return EXIT_FAILURE;
+    }
+
+    Mix_Volume(-1, MIX_MAX_VOLUME / 4);
+
+    if (!headless) {
+        win = SDL_CreateWindow(window_title, SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, screen_width, screen_height, 0);
+
+        if (win == NULL) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (cpu_renderer) {
+        if (!init_framebuffer()) {
+            return EXIT_FAILURE;
+        }
+    } else {
+        uint32_t renderer_flags = software_renderer ? SDL_RENDERER_SOFTWARE : SDL_RENDERER_ACCELERATED;
+        if (bench_frames == 0) {
+            renderer_flags |= SDL_RENDERER_PRESENTVSYNC;
+        }
+        if (software_renderer) {
+            SDL_SetHint(SDL_HINT_RENDER_DRIVER, "software");
+        }
+        renderer = SDL_CreateRenderer(win, -1, renderer_flags);
+        if (renderer == NULL) {
+            return EXIT_FAILURE;
+        }
+
+        SDL_SetRenderDrawColor(renderer, 32, 32, 64, 255);
+
+        SDL_RenderSetLogicalSize(renderer, screen_width, screen_height);
+    }
+
+    PROFILE_BEGIN("load assets");
+    if (!load_assets()) {
+        return EXIT_FAILURE;
+    }
+    PROFILE_END();
+    print_asset_memory();
+#ifdef HOT_RELOAD
+    if (hot_reload) {
+        watch_assets();
+    }
+#endif
 
     init();
 
+    if (bench_frames > 0) {
+        run_render_benchmark(bench_frames);
+        should_quit = true;
+    }
+
+#ifdef SIM_THREAD
+    if (!should_quit) {
+        sim_wake = SDL_CreateSemaphore(0);
+        if (sim_wake == NULL) {
+            return EXIT_FAILURE;
+        }
+        sim_thread = SDL_CreateThread(sim_thread_main, "sim", NULL);
+        if (sim_thread == NULL) {
+            return EXIT_FAILURE;
+        }
+    }
+#endif
+
 #ifdef __EMSCRIPTEN__
+    emscripten_set_visibilitychange_callback(NULL, false, on_visibility_change);
     emscripten_set_main_loop(one_iter, 60, 1);
 #else
+    // Frames are paced by new snapshots and vsync. Between them, sleep until
+    // the next one is due, or until an event arrives so that input reaches
+    // the simulation right away. When idle, block until an event arrives
+    // instead, waking now and then to pick up asset changes if watching them.
     while (!should_quit) {
         one_iter();
-        SDL_Delay(16);
+        if (is_idle()) {
+#ifdef HOT_RELOAD
+            if (assets_inotify >= 0) {
+                SDL_WaitEventTimeout(NULL, IDLE_WAIT_TIMEOUT);
+            } else {
+                SDL_WaitEvent(NULL);
+            }
+#else
+            SDL_WaitEvent(NULL);
+#endif
+        } else {
+            SDL_WaitEventTimeout(NULL, time_to_next_snapshot());
+        }
+    }
+#endif
+
+#ifdef SIM_THREAD
+    if (sim_thread != NULL) {
+        SDL_AtomicSet(&sim_stop, 1);
+        wake_sim();
+        SDL_WaitThread(sim_thread, NULL);
+        SDL_DestroySemaphore(sim_wake);
     }
 #endif
 
-    Mix_FreeChunk(sfx_jump);
-    Mix_FreeChunk(sfx_game_over);
-    Mix_FreeChunk(sfx_bounce_start);
-    Mix_FreeChunk(sfx_bounce_end);
-    Mix_FreeChunk(sfx_brick_break);
+#ifdef NETPLAY
+    if (SDL_AtomicGet(&net_disconnected) && win != NULL) {
+        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_INFORMATION, window_title, "The other player disconnected.", win);
+    }
+    net_close();
+#endif
+#ifdef TELEMETRY
+    telemetry_close();
+#endif
+
+    PROFILE_DUMP(trace_path);
+
+    if (capture_path != NULL && framebuffer != NULL && save_framebuffer(capture_path)) {
+        printf("wrote %s\n", capture_path);
+    }
+
+    free_assets();
     Mix_CloseAudio();
     Mix_Quit();
 
     IMG_Quit();
 
-    SDL_DestroyRenderer(renderer);
-    SDL_DestroyWindow(win);
+    free_framebuffer();
+    if (renderer != NULL) {
+        SDL_DestroyRenderer(renderer);
+    }
+    if (win != NULL) {
+        SDL_DestroyWindow(win);
+    }
     SDL_Quit();
 
     return EXIT_SUCCESS;
 }
 
+#ifdef NETPLAY
+// Bind to local_port and send to peer ("host:port"). The level seed is agreed
+// on once the first packet from the peer arrives.
+bool net_open(uint16_t local_port, const char *peer) {
+    char host[256];
+    const char *colon = strrchr(peer, ':');
+    if (colon == NULL || colon - peer >= (int)sizeof(host)) {
+        fprintf(stderr, "expected host:port, got %s\n", peer);
+        return false;
+    }
+    memcpy(host, peer, colon - peer);
+    host[colon - peer] = '\0';
+
+    memset(&net_peer, 0, sizeof(net_peer));
+    net_peer.sin_family = AF_INET;
+    net_peer.sin_port = htons(atoi(colon + 1));
+    if (inet_pton(AF_INET, host, &net_peer.sin_addr) != 1) {
+        fprintf(stderr, "invalid peer address %s\n", host);
+        return false;
+    }
+
+    net_socket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (net_socket < 0) {
+        perror("socket");
+        return false;
+    }
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(local_port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(net_socket, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        close(net_socket);
+        net_socket = -1;
+        return false;
+    }
+    fcntl(net_socket, F_SETFL, fcntl(net_socket, F_GETFL) | O_NONBLOCK);
+
+    gettimeofday(&tv, NULL);
+    net_seed = (uint32_t)(tv.tv_sec * 1000003u) ^ (uint32_t)tv.tv_usec ^ ((uint32_t)local_port << 16);
+    net_loss_state = net_seed | 1;
+    net_test_rng = local_port;
+    net_connected = false;
+    net_frame = 0;
+    remote_confirmed = 0;
+    remote_ack = 0;
+    rollback_from = UINT32_MAX;
+    net_restart_step = UINT32_MAX;
+    net_restart_checked = 0;
+    memset(net_restart_steps, 0xff, sizeof(net_restart_steps));
+    net_queue_len = 0;
+    return true;
+}
+
+void net_close() {
+    if (net_socket < 0) {
+        return;
+    }
+    close(net_socket);
+    net_socket = -1;
+    printf("rollbacks: %u, max rollback: %u steps, max resimulation: %.3f ms, stalls: %u\n",
+           num_rollbacks, max_rollback_steps,
+           (double)max_rollback_ticks * 1000.0 / (double)SDL_GetPerformanceFrequency(), num_stalls);
+}
+
+// Hand a packet to the socket, or to the artificial latency queue.
+void net_send() {
+    net_packet_t packet;
+    uint32_t first = remote_ack;
+    uint32_t count = net_connected ? net_frame - first : 0;
+    if (count > NET_MAX_INPUTS_PER_PACKET) {
+        count = NET_MAX_INPUTS_PER_PACKET;
+    }
+    put_u32(&packet.data[0], NET_MAGIC);
+    put_u32(&packet.data[4], net_seed);
+    put_u32(&packet.data[8], remote_confirmed);
+    put_u32(&packet.data[12], first);
+    packet.data[16] = count;
+    for (uint32_t i = 0; i < count; i++) {
+        packet.data[NET_PACKET_HEADER_SIZE + i] = local_inputs[(first + i) % NET_HISTORY];
+    }
+    packet.len = NET_PACKET_HEADER_SIZE + count;
+    packet.send_time = SDL_GetTicks() + net_delay;
+
+    if (net_loss > 0.0f) {
+        net_loss_state ^= net_loss_state << 13;
+        net_loss_state ^= net_loss_state >> 17;
+        net_loss_state ^= net_loss_state << 5;
+        if ((float)net_loss_state / (float)UINT32_MAX < net_loss) {
+            return;
+        }
+    }
+    if (net_queue_len < NET_QUEUE_SIZE) {
+        net_queue[net_queue_len++] = packet;
+    }
+
+    uint32_t ticks = SDL_GetTicks();
+    int sent = 0;
+    while (sent < net_queue_len && (int32_t)(ticks - net_queue[sent].send_time) >= 0) {
+        sendto(net_socket, net_queue[sent].data, net_queue[sent].len, 0, (struct sockaddr *)&net_peer, sizeof(net_peer));
+        sent++;
+    }
+    memmove(net_queue, net_queue + sent, (net_queue_len - sent) * sizeof(net_packet_t));
+    net_queue_len -= sent;
+}
+
+// Drain the socket, recording confirmed remote inputs. A confirmed input that
+// differs from the one predicted for an already simulated step schedules a
+// rollback to that step.
+void net_receive() {
+    uint8_t data[NET_MAX_PACKET_SIZE];
+    for (;;) {
+        ssize_t len = recv(net_socket, data, sizeof(data), 0);
+        if (len < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNREFUSED) {
+                perror("recv");
+            }
+            return;
+        }
+        if (len < NET_PACKET_HEADER_SIZE || get_u32(&data[0]) != NET_MAGIC || len < NET_PACKET_HEADER_SIZE + data[16]) {
+            continue;
+        }
+
+        net_last_receive_time = SDL_GetTicks();
+        uint32_t seed = get_u32(&data[4]);
+        if (!net_connected) {
+            net_connected = true;
+            net_seed = seed < net_seed ? seed : net_seed;
+            init_seeded(net_seed);
+#ifdef TELEMETRY
+            telemetry_start_level(net_seed);
+#endif
+            save_state(&local_state);
+            save_state(&remote_state);
+            printf("connected, seed %u\n", net_seed);
+        }
+
+        uint32_t ack = get_u32(&data[8]);
+        if (ack > remote_ack && ack <= net_frame) {
+            remote_ack = ack;
+        }
+
+        uint32_t first = get_u32(&data[12]);
+        uint32_t count = data[16];
+        for (uint32_t f = first; f < first + count; f++) {
+            if (f < remote_confirmed) {
+                continue;
+            }
+            if (f > remote_confirmed || f >= net_frame + NET_HISTORY / 2) {
+                break;
+            }
+            uint8_t in = data[NET_PACKET_HEADER_SIZE + (f - first)];
+            if (f < net_frame && remote_inputs[f % NET_HISTORY] != in && f < rollback_from) {
+                rollback_from = f;
+            }
+            remote_inputs[f % NET_HISTORY] = in;
+            remote_confirmed++;
+        }
+    }
+}
+
+// Run one frame of versus mode: exchange inputs, roll the remote simulation
+// back to the first step whose input or prediction changed and replay it,
+// then advance both simulations by one step with the remote input predicted
+// from its last known value. The local player is stalled instead if the peer
+// falls too far behind.
+void net_update(uint8_t input) {
+    PROFILE_ZONE("net update");
+    if (SDL_AtomicGet(&net_disconnected)) {
+        return;
+    }
+    net_receive();
+    if (!net_connected) {
+        net_send();
+        return;
+    }
+    if (SDL_GetTicks() - net_last_receive_time > NET_TIMEOUT) {
+        fprintf(stderr, "peer disconnected\n");
+        SDL_AtomicSet(&net_disconnected, 1);
+        SDL_Event quit = {.type = SDL_QUIT};
+        SDL_PushEvent(&quit);
+        return;
+    }
+
+    // Steps simulated ahead of the peer were predicted from whatever was
+    // known at the time. Predict them again from the newest confirmed input,
+    // so a held input costs one rollback rather than one per arriving packet.
+    if (remote_confirmed > 0) {
+        uint8_t predicted = remote_inputs[(remote_confirmed - 1) % NET_HISTORY];
+        for (uint32_t f = remote_confirmed; f < net_frame; f++) {
+            if (remote_inputs[f % NET_HISTORY] != predicted) {
+                remote_inputs[f % NET_HISTORY] = predicted;
+                if (f < rollback_from) {
+                    rollback_from = f;
+                }
+            }
+        }
+    }
+
+    // A restart request in either player's input at step s, once both inputs
+    // for s are known, restarts both simulations at s + NET_RESTART_DELAY.
+    // Neither client has simulated that far yet when it sees the request:
+    // the local player is stalled NET_MAX_ROLLBACK steps past the last
+    // confirmed remote input. Requests up to and including the restart step
+    // itself, whose input was read before the new level started, are part of
+    // the same restart.
+    while (net_restart_checked < net_frame && net_restart_checked < remote_confirmed) {
+        uint32_t s = net_restart_checked++;
+        uint8_t both = local_inputs[s % NET_HISTORY] | remote_inputs[s % NET_HISTORY];
+        bool pending = net_restart_step != UINT32_MAX && net_restart_step >= s;
+        if ((both & INPUT_RESTART) && !pending) {
+            net_restart_step = s + NET_RESTART_DELAY;
+            net_restart_steps[net_restart_step % NET_HISTORY] = net_restart_step;
+        }
+    }
+
+    if (net_test_steps > 0) {
+        // Hold each scripted input for a few steps, like a player would.
+        if (net_frame % 8 == 0) {
+            net_test_input = (next_random(&net_test_rng) >> 24) & (INPUT_LEFT | INPUT_RIGHT | INPUT_JUMP | INPUT_RESTART);
+        }
+        input = net_test_input;
+    }
+
+    // Only ask for a restart once both players are out.
+    if (!game_over || !remote_state.game_over) {
+        input &= ~INPUT_RESTART;
+    }
+
+    if (rollback_from < net_frame) {
+        PROFILE_ZONE("rollback");
+        uint64_t start = SDL_GetPerformanceCounter();
+        save_state(&local_state);
+        load_state(&remote_history[rollback_from % NET_HISTORY]);
+        sfx_muted = true;
+        for (uint32_t f = rollback_from; f < net_frame; f++) {
+            save_state(&remote_history[f % NET_HISTORY]);
+            net_step(f, remote_inputs[f % NET_HISTORY], false);
+        }
+        sfx_muted = false;
+        save_state(&remote_state);
+        load_state(&local_state);
+        uint64_t elapsed = SDL_GetPerformanceCounter() - start;
+
+        num_rollbacks++;
+        if (net_frame - rollback_from > max_rollback_steps) {
+            max_rollback_steps = net_frame - rollback_from;
+        }
+        if (elapsed > max_rollback_ticks) {
+            max_rollback_ticks = elapsed;
+        }
+        rollback_from = UINT32_MAX;
+    }
+
+    if (net_test_steps > 0 && net_frame >= net_test_steps) {
+        net_test_update();
+    } else if (net_frame < remote_confirmed + NET_MAX_ROLLBACK && net_frame + 1 - remote_ack < NET_HISTORY) {
+        local_inputs[net_frame % NET_HISTORY] = input;
+        net_step(net_frame, input, true);
+        if (score > high_score) {
+            high_score = score;
+        }
+#ifdef TELEMETRY
+        telemetry_record_tick();
+#endif
+
+        if (net_frame >= remote_confirmed) {
+            remote_inputs[net_frame % NET_HISTORY] = remote_confirmed > 0 ? remote_inputs[(remote_confirmed - 1) % NET_HISTORY] : 0;
+        }
+        save_state(&local_state);
+        load_state(&remote_state);
+        save_state(&remote_history[net_frame % NET_HISTORY]);
+        sfx_muted = true;
+        net_step(net_frame, remote_inputs[net_frame % NET_HISTORY], false);
+        sfx_muted = false;
+        save_state(&remote_state);
+        load_state(&local_state);
+
+        net_frame++;
+    } else {
+        num_stalls++;
+    }
+
+    net_send();
+}
+
+// FNV-1a of the snapshot of whatever simulation is loaded.
+uint64_t hash_loaded_state() {
+    snapshot_t s;
+    memset(&s, 0, sizeof(s)); // padding too
+    save_state(&s);
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < sizeof(s); i++) {
+        hash ^= ((const uint8_t *)&s)[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Called once both simulations have reached net_test_steps. Report both
+// states as soon as every remote input is in, then quit once the peer has
+// acknowledged all of ours.
+void net_test_update() {
+    if (!net_test_reported && remote_confirmed >= net_test_steps && rollback_from == UINT32_MAX) {
+        uint64_t local_hash = hash_loaded_state();
+        save_state(&local_state);
+        load_state(&remote_state);
+        uint64_t remote_hash = hash_loaded_state();
+        load_state(&local_state);
+        printf("net-test: steps %u local %016llx remote %016llx max_rollback_steps %u max_rollback_ms %.3f\n",
+               net_test_steps, (unsigned long long)local_hash, (unsigned long long)remote_hash, max_rollback_steps,
+               (double)max_rollback_ticks * 1000.0 / (double)SDL_GetPerformanceFrequency());
+        fflush(stdout);
+        net_test_reported = true;
+    }
+    if (net_test_reported && remote_ack >= net_test_steps) {
+        SDL_Event quit = {.type = SDL_QUIT};
+        SDL_PushEvent(&quit);
+    }
+}
+
+// Step whichever player's simulation is loaded through step f, first starting
+// a new level if both clients agreed to restart at f. The seed only depends on
+// values both clients share.
+void net_step(uint32_t f, uint8_t input, bool local) {
+    if (net_restart_steps[f % NET_HISTORY] == f) {
+        uint32_t seed = net_seed + f;
+        init_seeded(next_random(&seed));
+#ifdef TELEMETRY
+        if (local) {
+            telemetry_start_level(level_seed);
+        }
+#endif
+    }
+    step(input);
+}
+#endif
+
 bool check_collision_rect_rect(float ax, float ay, float aw, float ah, float bx, float by, float bw, float bh) {
     bool x = bx <= ax + aw && ax <= bx + bw;
     bool y = by <= ay + ah && ay <= by + bh;
@@ -848,8 +3155,16 @@ float pivot(float velocity) {
     return fmax(0.0f, velocity - player_max_velocity / time_to_pivot);
 }
 
-float rand_range(float min, float max) {
-    float r = (float)rand() / (float)RAND_MAX;
+// PCG-RXS-M-XS. Levels are generated from a local state rather than rand() so
+// that they can be generated on several threads at once.
+uint32_t next_random(uint32_t *state) {
+    *state = *state * 747796405u + 2891336453u;
+    uint32_t word = ((*state >> ((*state >> 28) + 4)) ^ *state) * 277803737u;
+    return (word >> 22) ^ word;
+}
+
+float rand_range(uint32_t *state, float min, float max) {
+    float r = (float)(next_random(state) >> 8) / (float)(1 << 24);
     return min + r * (max - min);
 }
 
@@ -0,0 +1,29 @@
+#!/bin/sh
+# Render the last frame of a short benchmark run with the CPU renderer and
+# compare it byte for byte with a checked-in golden image. Run it against
+# builds with and without SSE2 to check that both blending paths agree.
+#
+# usage: tests/render_golden.sh [binary]   (run from the repository root)
+#
+# After an intended change to rendering or the assets, regenerate the image
+# with:
+#   ./imhp --bench-render 60 --headless --capture frame.ppm
+#   gzip -9n < frame.ppm > tests/golden/bench_render_60.ppm.gz
+
+BINARY=${1:-./imhp}
+GOLDEN=tests/golden/bench_render_60.ppm.gz
+
+frame=$(mktemp)
+expected=$(mktemp)
+trap 'rm -f "$frame" "$expected"' EXIT
+
+if ! "$BINARY" --bench-render 60 --headless --capture "$frame" >/dev/null; then
+    echo "FAIL: $BINARY did not render"
+    exit 1
+fi
+gzip -dc "$GOLDEN" >"$expected"
+if ! cmp -s "$frame" "$expected"; then
+    echo "FAIL: $BINARY's frame differs from $GOLDEN"
+    exit 1
+fi
+echo "PASS: $BINARY"
@@ -0,0 +1,64 @@
+#!/bin/sh
+# Play two headless versus clients against each other over loopback, using
+# scripted inputs, in a few network setups. Each client's view of the remote
+# player must match the other client's own state, and no rollback may take
+# longer than a frame to resimulate.
+#
+# usage: tests/versus_loopback.sh [binary]   (run from the repository root)
+
+BINARY=${1:-./imhp}
+STEPS=${STEPS:-900}
+BUDGET_MS=16.6
+
+out_a=$(mktemp)
+out_b=$(mktemp)
+trap 'rm -f "$out_a" "$out_b"' EXIT
+
+field() {
+    echo "$1" | awk -v name="$2" '{ for (i = 1; i < NF; i++) if ($i == name) print $(i + 1) }'
+}
+
+# run_case <name> <seconds before starting the second client> <client A options> <client B options>
+run_case() {
+    echo "$1:"
+    timeout 60 "$BINARY" --headless --versus 7300 127.0.0.1:7301 $3 --net-test "$STEPS" >"$out_a" &
+    pid_a=$!
+    sleep "$2"
+    timeout 60 "$BINARY" --headless --versus 7301 127.0.0.1:7300 $4 --net-test "$STEPS" >"$out_b"
+    wait $pid_a
+
+    result_a=$(grep '^net-test:' "$out_a")
+    result_b=$(grep '^net-test:' "$out_b")
+    if [ -z "$result_a" ] || [ -z "$result_b" ]; then
+        echo "FAIL: a client did not finish"
+        cat "$out_a" "$out_b"
+        status=1
+        return
+    fi
+    echo "7300 $result_a"
+    echo "7301 $result_b"
+
+    if [ "$(field "$result_a" local)" != "$(field "$result_b" remote)" ]; then
+        echo "FAIL: 7301's view of 7300 differs from 7300's own state"
+        status=1
+    fi
+    if [ "$(field "$result_b" local)" != "$(field "$result_a" remote)" ]; then
+        echo "FAIL: 7300's view of 7301 differs from 7301's own state"
+        status=1
+    fi
+    for result in "$result_a" "$result_b"; do
+        ms=$(field "$result" max_rollback_ms)
+        if awk -v ms="$ms" -v budget="$BUDGET_MS" 'BEGIN { exit !(ms > budget) }'; then
+            echo "FAIL: resimulation took $ms ms, over the $BUDGET_MS ms budget"
+            status=1
+        fi
+    done
+}
+
+status=0
+run_case "delay and loss" 0 "--net-delay 40 --net-loss 10" "--net-delay 60 --net-loss 10"
+# The first client is already sending inputs when the second one connects.
+run_case "staggered start, no delay" 1 "" ""
+run_case "staggered start, loss" 1 "--net-loss 10" "--net-loss 10"
+[ $status -eq 0 ] && echo "PASS"
+exit $status